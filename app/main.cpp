@@ -1,69 +1,184 @@
 #include <algorithm>
 #include <float.h>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 
 #include "fasta_helper.h"
+#include "partition_helper.h"
 #include "pll_smc.h"
+#include "smc_engine.h"
 
-void print_tree(std::shared_ptr<PhyloTreeNode> root, std::ostream &stream) {
-  if (root->edge_l && root->edge_r) {
-    stream << "(";
-    print_tree(root->edge_l->child, stream);
-    stream << ":" << root->edge_l->length;
-    stream << ", ";
-    print_tree(root->edge_r->child, stream);
-    stream << ":" << root->edge_r->length;
-    stream << ")";
+/**
+   Writes the trees of a finished job to stdout and the tree with the largest
+   normalized weight to stderr.
+ */
+void print_trees(const std::vector<SMCTree> &trees) {
+  const SMCTree *best = nullptr;
+  double max = -DBL_MAX;
+
+  for (auto &tree : trees) {
+    if (tree.normalized_weight > max) {
+      max = tree.normalized_weight;
+      best = &tree;
+    }
+
+    std::cout << tree.normalized_weight << " " << tree.newick << ";"
+              << std::endl;
+  }
+
+  if (best) {
+    std::cerr << "Weight: " << best->weight
+              << ", Normalized weight: " << best->normalized_weight
+              << std::endl;
+    std::cerr << best->newick << ";" << std::endl;
   } else {
-    std::string label(root->label);
-    stream << label;
+    std::cerr << "Couldn't find particle with largest normalized weight"
+              << std::endl;
   }
 }
 
 int main(int argc, char *argv[]) {
   unsigned int particle_count = 1000;
-  if (argc < 2) {
+  SMCOptions options;
+  bool validate_precision = false;
+  bool batch = false;
+  std::string partition_path;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; i++) {
+    std::string argument(argv[i]);
+
+    if (argument == "--single-precision") {
+      options.clv_precision = CLVPrecision::SINGLE;
+    } else if (argument == "--rejuvenate" && i + 1 < argc) {
+      options.rejuvenation_moves = atoi(argv[++i]);
+    } else if (argument == "--threads" && i + 1 < argc) {
+      options.thread_count = atoi(argv[++i]);
+    } else if (argument == "--numa") {
+      options.numa = true;
+    } else if (argument == "--fake-numa" && i + 1 < argc) {
+      options.fake_numa_nodes = atoi(argv[++i]);
+    } else if (argument == "--target-ess" && i + 1 < argc) {
+      options.target_ess = atof(argv[++i]);
+    } else if (argument == "--min-particles" && i + 1 < argc) {
+      options.min_particle_count = atoi(argv[++i]);
+    } else if (argument == "--max-particles" && i + 1 < argc) {
+      options.max_particle_count = atoi(argv[++i]);
+    } else if (argument == "--memory-budget" && i + 1 < argc) {
+      options.memory_budget = atof(argv[++i]) * 1024 * 1024;
+    } else if (argument == "--degrade-precision") {
+      options.degrade_on_memory_budget = true;
+    } else if (argument == "--distance-proposal") {
+      options.distance_proposal = true;
+    } else if (argument == "--partitions" && i + 1 < argc) {
+      partition_path = argv[++i];
+    } else if (argument == "--batch") {
+      batch = true;
+    } else if (argument == "--validate-precision") {
+      validate_precision = true;
+    } else if (argument.compare(0, 2, "--") == 0) {
+      std::cerr << "Unknown option " << argument << std::endl;
+      return 1;
+    } else {
+      positional.push_back(argument);
+    }
+  }
+
+  if (positional.empty()) {
     std::cerr << "Missing Fasta file path argument!";
     return 1;
-  } else if (argc == 3) {
-    particle_count = atoi(argv[2]);
+  } else if (positional.size() > 1) {
+    particle_count = atoi(positional[1].c_str());
   }
 
-  std::vector<std::pair<std::string, std::string>> sequences =
-      parse_sequences(argv[1]);
+  if (batch) {
+    // Every line of the batch file is the path of a Fasta file, optionally
+    // followed by the path of its partition file.
+    std::ifstream batch_file(positional[0]);
+    if (!batch_file) {
+      std::cerr << "Can't open batch file " << positional[0] << std::endl;
+      return 1;
+    }
 
-  std::cerr << "Running SMC for " << sequences.size() - 1 << " iterations with "
-            << particle_count << " particles" << std::endl;
+    std::vector<std::string> paths;
+    std::vector<std::vector<std::pair<std::string, std::string>>> alignments;
+    std::vector<std::vector<AlignmentPartition>> partitions;
+    try {
+      for (std::string line; std::getline(batch_file, line);) {
+        std::istringstream fields(line);
+        std::string path, alignment_partition_path;
+        if (!(fields >> path))
+          continue;
+        fields >> alignment_partition_path;
 
-  std::vector<Particle *> particles = run_smc(particle_count, sequences);
+        paths.push_back(path);
+        alignments.push_back(parse_sequences(path));
+        partitions.push_back(
+            alignment_partition_path.empty()
+                ? std::vector<AlignmentPartition>()
+                : parse_partitions(alignment_partition_path,
+                                   alignments.back()[0].second.length()));
+      }
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
 
-  Particle *particle = nullptr;
-  double max = -DBL_MAX;
+    std::cerr << "Running SMC for " << alignments.size()
+              << " alignments with " << particle_count << " particles"
+              << std::endl;
+
+    SMCEngine engine(options);
+    std::vector<std::vector<SMCTree>> results;
+    try {
+      results = engine.run_batch(particle_count, alignments, partitions);
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
 
-  for (auto &p : particles) {
-    if (p->get_roots().size() > 1)
-      continue;
-    if (p->normalized_weight > max) {
-      max = p->normalized_weight;
-      particle = p;
+    for (unsigned int i = 0; i < results.size(); i++) {
+      std::cout << "# " << paths[i] << std::endl;
+      std::cerr << "# " << paths[i] << std::endl;
+      print_trees(results[i]);
     }
 
-    std::cout << p->normalized_weight << " ";
-    print_tree(p->get_roots().front(), std::cout);
-    std::cout << ";" << std::endl;
+    return 0;
   }
 
-  if (particle) {
-    std::cerr << "Weight: " << particle->weight
-              << ", Normalized weight: " << particle->normalized_weight
-              << std::endl;
+  std::vector<std::pair<std::string, std::string>> sequences =
+      parse_sequences(positional[0]);
 
-    assert(particle->get_roots().size() == 1);
-    print_tree(particle->get_roots()[0], std::cerr);
-    std::cout << ";" << std::endl;
-  } else {
-    std::cerr << "Couldn't find particle with largest normalized weight"
+  std::vector<AlignmentPartition> partitions;
+  if (!partition_path.empty()) {
+    try {
+      partitions =
+          parse_partitions(partition_path, sequences[0].second.length());
+    } catch (const std::runtime_error &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (validate_precision) {
+    std::cerr << "Max log-likelihood difference between double and single "
+                 "precision CLVs: "
+              << validate_single_precision(sequences, 100, partitions)
               << std::endl;
+    return 0;
+  }
+
+  std::cerr << "Running SMC for " << sequences.size() - 1 << " iterations with "
+            << particle_count << " particles" << std::endl;
+
+  SMCEngine engine(options);
+  try {
+    print_trees(engine.run(particle_count, sequences, partitions));
+  } catch (const std::runtime_error &error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
   }
 }
@@ -0,0 +1,49 @@
+#ifndef LIB_PLL_SMC_DISTANCE_MATRIX_H
+#define LIB_PLL_SMC_DISTANCE_MATRIX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+/**
+   Pairwise Jukes-Cantor distances between a set of sequences.
+
+   Sequences are encoded with four bits per site, one per nucleotide, and
+   packed sixteen sites to a 64 bit word. Two sites match if their state sets
+   intersect, so mismatches of a whole word are counted with a few shifts and
+   a popcount.
+ */
+class DistanceMatrix {
+  unsigned int sequence_count;
+  unsigned int site_count;
+  std::vector<float> distances;
+
+public:
+  /**
+     Computes the distances between all pairs of sequences, spreading the rows
+     over the threads of 'thread_pool'.
+   */
+  DistanceMatrix(const std::vector<std::pair<std::string, std::string>> &sequences,
+                 ThreadPool &thread_pool);
+
+  /**
+     Distance between the sequences with index 'i' and 'j'.
+   */
+  double distance(const unsigned int i, const unsigned int j) const {
+    return distances[i * sequence_count + j];
+  }
+
+  /**
+     Number of sequences.
+   */
+  unsigned int get_sequence_count() const { return sequence_count; }
+
+  /**
+     Number of sites of every sequence.
+   */
+  unsigned int get_site_count() const { return site_count; }
+};
+
+#endif
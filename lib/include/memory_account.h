@@ -0,0 +1,161 @@
+#ifndef LIB_PLL_SMC_MEMORY_ACCOUNT_H
+#define LIB_PLL_SMC_MEMORY_ACCOUNT_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+struct PLLBufferManager;
+
+/**
+   Kinds of memory tracked by a MemoryAccount.
+ */
+enum class MemoryCategory : unsigned int {
+  CLV,
+  SCALER,
+  PMATRIX,
+  NODE,
+  EDGE,
+  PARTICLE
+};
+
+const unsigned int memory_category_count = 6;
+
+/**
+   Keeps track of the number of bytes which are in use ('live') or kept for
+   reuse ('pooled') for each memory category, together with the peak usage
+   since the last call to 'reset_peaks'. An optional budget limits the total.
+
+   The account knows the buffer managers recording in it, so that the memory
+   pooled by any of them can be reclaimed when the budget is reached.
+
+   All counters are atomic and may be updated from any thread.
+ */
+class MemoryAccount {
+  std::atomic<size_t> live[memory_category_count];
+  std::atomic<size_t> pooled[memory_category_count];
+  std::atomic<size_t> peak[memory_category_count];
+  std::atomic<size_t> peak_total;
+  std::atomic<bool> degraded;
+
+  /**
+     Managers recording in the account. Never locked while holding the mutex
+     of a manager.
+   */
+  std::vector<PLLBufferManager *> managers;
+  std::mutex managers_mutex;
+
+  /**
+     Raises the peaks after 'category' has grown.
+   */
+  void update_peaks(MemoryCategory category);
+
+public:
+  /**
+     Budget in bytes for the total of live and pooled memory. Zero means no
+     budget.
+   */
+  size_t budget;
+
+  /**
+     Switch CLV storage to single precision once three quarters of the budget
+     are used, leaving room for the double precision CLVs still in use. The
+     budget itself is still enforced.
+   */
+  bool degrade_on_budget;
+
+  MemoryAccount();
+
+  MemoryAccount(const MemoryAccount &) = delete;
+  MemoryAccount &operator=(const MemoryAccount &) = delete;
+
+  /**
+     Accounts for 'bytes' of newly allocated memory.
+   */
+  void allocate(MemoryCategory category, size_t bytes);
+
+  /**
+     Accounts for 'bytes' of live memory being freed.
+   */
+  void release(MemoryCategory category, size_t bytes);
+
+  /**
+     Accounts for 'bytes' of live memory being kept for reuse.
+   */
+  void pool(MemoryCategory category, size_t bytes);
+
+  /**
+     Accounts for 'bytes' of pooled memory being reused.
+   */
+  void reuse(MemoryCategory category, size_t bytes);
+
+  /**
+     Accounts for 'bytes' of pooled memory being freed.
+   */
+  void release_pooled(MemoryCategory category, size_t bytes);
+
+  size_t get_live(MemoryCategory category) const {
+    return live[(unsigned int)category];
+  }
+  size_t get_pooled(MemoryCategory category) const {
+    return pooled[(unsigned int)category];
+  }
+
+  /**
+     Total live and pooled bytes of all categories.
+   */
+  size_t total() const;
+
+  /**
+     Returns true if allocating 'bytes' more would exceed the budget.
+   */
+  bool exceeds_budget(size_t bytes) const {
+    return budget > 0 && total() + bytes > budget;
+  }
+
+  /**
+     Returns true if allocating 'bytes' more should degrade to a lower memory
+     mode.
+   */
+  bool exceeds_degrade_threshold(size_t bytes) const {
+    return degrade_on_budget && budget > 0 && total() + bytes > budget / 4 * 3;
+  }
+
+  /**
+     Records that a manager switched to single precision CLVs, see
+     'degrade_on_budget'.
+   */
+  void record_degradation() { degraded = true; }
+
+  /**
+     Returns true if a manager degraded since the last call, so that the
+     owner of the account can report it.
+   */
+  bool take_degradation() { return degraded.exchange(false); }
+
+  /**
+     Registers or unregisters a manager recording in the account, see
+     'PLLBufferManager::set_memory_account'.
+   */
+  void add_manager(PLLBufferManager *manager);
+  void remove_manager(PLLBufferManager *manager);
+
+  /**
+     Frees the pooled buffers of all managers recording in the account.
+   */
+  void free_pooled_buffers();
+
+  /**
+     Writes the peak and current usage of every category to 'stream'.
+   */
+  void report(std::ostream &stream) const;
+
+  /**
+     Starts a new peak measurement from the current usage.
+   */
+  void reset_peaks();
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef LIB_PLL_SMC_NUMA_TOPOLOGY_H
+#define LIB_PLL_SMC_NUMA_TOPOLOGY_H
+
+#include <vector>
+
+/**
+   The NUMA nodes of a machine as the CPUs belonging to each node. An empty
+   topology stands for a single node whose threads are not pinned.
+ */
+struct NumaTopology {
+  std::vector<std::vector<unsigned int>> node_cpus;
+
+  unsigned int node_count() const {
+    return node_cpus.empty() ? 1 : node_cpus.size();
+  }
+};
+
+/**
+   Reads the NUMA nodes and their CPUs from /sys/devices/system/node. Nodes
+   without CPUs are skipped. Returns a single node with all CPUs if the
+   topology can't be read.
+ */
+NumaTopology detect_numa_topology();
+
+/**
+   Splits the CPUs the process may run on into 'node_count' nodes, to test
+   NUMA-aware code on machines with a single node. If there are fewer CPUs
+   than nodes, nodes share CPUs.
+ */
+NumaTopology fake_numa_topology(const unsigned int node_count);
+
+/**
+   Returns the CPUs the calling thread may run on.
+ */
+std::vector<unsigned int> available_cpus();
+
+/**
+   Restricts the calling thread to 'cpus'. Does nothing on platforms without
+   thread affinity.
+ */
+void set_thread_cpus(const std::vector<unsigned int> &cpus);
+
+/**
+   Restricts the calling thread to the CPUs of 'node'. Does nothing for an
+   empty topology or on platforms without thread affinity.
+ */
+void pin_thread(const NumaTopology &topology, const unsigned int node);
+
+#endif
@@ -15,19 +15,47 @@ class Particle {
   PhyloForest *forest;
   std::mt19937 mt_generator;
 
+  /**
+     Chooses two roots to connect with probability decreasing with their
+     distance. Returns the log of the ratio between the prior probability of
+     the pair and the probability of proposing it.
+   */
+  double propose_close_pair(int &i, int &j);
+
+  /**
+     The merge chosen by 'prepare_proposal' and the log ratio of its pair
+     probabilities, completed by 'finish_proposal'.
+   */
+  PendingMerge pending_merge;
+  double pending_ln_pair_ratio;
+
+  /**
+     Chooses the roots to merge and the height of the merge, and creates the
+     new edges without building their pmatrices.
+   */
+  void prepare_proposal();
+
+  /**
+     Connects the pending merge once its pmatrices are built and updates the
+     weight.
+   */
+  void finish_proposal();
+
 public:
   double weight;
   double normalized_weight;
 
   /**
      Constructs a particle with a weight, a vector of sequences and the length
-     of each sequence.
+     of each sequence. If a 'distance_matrix' is given, pairs of roots are
+     proposed according to their distances instead of uniformly.
    */
   Particle(double weight,
            const std::vector<std::pair<std::string, std::string>> sequences,
            const unsigned int sequence_lengths,
-           const pll_partition_t *reference_partition,
-           PLLBufferManager *const pll_buffer_manager);
+           const ReferencePartitions *reference_partitions,
+           PLLBufferManager *const pll_buffer_manager,
+           const DistanceMatrix *distance_matrix = nullptr);
 
   /**
      Copy constructor. Copies the particles forest but creates a new random
@@ -50,6 +78,23 @@ public:
    */
   void propose();
 
+  /**
+     Proposes an update to each of the 'count' particles like 'propose', but
+     builds the pmatrices of all their new edges in one batch. The particles
+     must share their reference partitions.
+   */
+  static void propose_all(Particle *const *particles, const unsigned int count);
+
+  /**
+     Applies 'move_count' Metropolis-Hastings moves to the particles forest,
+     each either a height perturbation or a subtree exchange. The moves leave
+     the particles target distribution invariant. Returns the number of
+     accepted moves and adds the number of actually proposed moves to
+     'proposed_count'.
+   */
+  unsigned int rejuvenate(const unsigned int move_count,
+                          unsigned int &proposed_count);
+
   /**
      Returns the current roots of the particles forest.
    */
@@ -61,6 +106,18 @@ public:
      Returns the particles forest.
    */
   PhyloForest *get_forest() const { return forest; };
+
+  /**
+     Returns the memory account of the particles buffers.
+   */
+  MemoryAccount *get_memory_account() const {
+    return forest->get_buffer_manager()->memory_account;
+  }
 };
 
+/**
+   Bytes accounted for every particle, excluding its trees.
+ */
+const size_t particle_size = sizeof(Particle) + sizeof(PhyloForest);
+
 #endif
@@ -0,0 +1,133 @@
+#ifndef LIB_PLL_SMC_PARTICLE_POPULATION_H
+#define LIB_PLL_SMC_PARTICLE_POPULATION_H
+
+#include <string>
+#include <vector>
+
+#include "particle.h"
+#include "thread_pool.h"
+
+/**
+   The particles of an SMC run. The current generation is kept together with
+   the next generation that the following iteration writes into. The number of
+   particles may change between generations. Particles dropped when the
+   population shrinks are kept as spares and reused when it grows again, so
+   resizing doesn't reallocate the particles.
+
+   The particles are divided into shards, one per buffer manager, which are
+   stored after each other in the generation vectors. The particles of a
+   shard always use the shard's buffer manager. With one buffer manager per
+   NUMA node this keeps the buffers of a shard on its node. Given a thread
+   pool with a thread per node, the particles of a shard are also allocated
+   by a thread of its node.
+ */
+class ParticlePopulation {
+  /**
+     For every shard, a particle holding only the leaves. Spare particles are
+     reset to it so that they release their trees and buffers.
+   */
+  std::vector<Particle *> prototypes;
+  std::vector<unsigned int> shard_weights;
+
+  std::vector<Particle *> generation;
+  std::vector<Particle *> next_generation;
+
+  /**
+     Offsets of the shards in the generation vectors, with the total count as
+     the last entry.
+   */
+  std::vector<unsigned int> generation_shards;
+  std::vector<unsigned int> next_generation_shards;
+
+  std::vector<std::vector<Particle *>> spares;
+
+  ThreadPool *thread_pool;
+
+  /**
+     Calls 'function(shard)' for every shard, on a thread of node 'shard' if
+     the thread pool has a node for every shard.
+   */
+  template <typename Function> void for_each_shard(Function function) {
+    const unsigned int shards = shard_weights.size();
+    if (!thread_pool || shards == 1 || thread_pool->node_count() < shards) {
+      for (unsigned int shard = 0; shard < shards; shard++)
+        function(shard);
+      return;
+    }
+
+    std::vector<unsigned int> nodes(shards);
+    for (unsigned int shard = 0; shard < shards; shard++)
+      nodes[shard] = shard;
+    thread_pool->run_on_nodes(nodes, function);
+  }
+
+public:
+  /**
+     Creates a population of 'count' particles, each using the given vector of
+     sequences. Each particle starts with a weight of 1/'count'. There is one
+     shard for each of 'pll_buffer_managers', whose share of the particles
+     is given by 'shard_weights'. Without weights the shards are equally
+     large. Shard 'i' is allocated on node 'i' of 'thread_pool', if given.
+   */
+  ParticlePopulation(
+      const unsigned int count,
+      const std::vector<std::pair<std::string, std::string>> sequences,
+      const ReferencePartitions *reference_partitions,
+      const std::vector<PLLBufferManager *> &pll_buffer_managers,
+      const DistanceMatrix *distance_matrix = nullptr,
+      const std::vector<unsigned int> &shard_weights = {},
+      ThreadPool *thread_pool = nullptr);
+
+  /**
+     Deletes all particles, returning their buffers to the buffer managers.
+   */
+  ~ParticlePopulation();
+
+  ParticlePopulation(const ParticlePopulation &) = delete;
+  ParticlePopulation &operator=(const ParticlePopulation &) = delete;
+
+  /**
+     Sets the number of particles of the next generation. Particles of a
+     shard which shrinks become spares of that shard.
+   */
+  void resize_next_generation(const unsigned int count);
+
+  /**
+     Makes the next generation the current one.
+   */
+  void advance() {
+    generation.swap(next_generation);
+    generation_shards.swap(next_generation_shards);
+  }
+
+  const std::vector<Particle *> &get_generation() const { return generation; }
+  std::vector<Particle *> &get_next_generation() { return next_generation; }
+
+  const std::vector<unsigned int> &get_generation_shards() const {
+    return generation_shards;
+  }
+  const std::vector<unsigned int> &get_next_generation_shards() const {
+    return next_generation_shards;
+  }
+
+  unsigned int shard_count() const { return prototypes.size(); }
+
+  /**
+     Splits 'count' particles into shards proportionally to their weights.
+   */
+  std::vector<unsigned int> shard_sizes(const unsigned int count) const;
+
+  /**
+     Total number of particles allocated by the population.
+   */
+  unsigned int capacity() const {
+    unsigned int count =
+        generation.size() + next_generation.size() + prototypes.size();
+    for (auto &shard_spares : spares)
+      count += shard_spares.size();
+
+    return count;
+  }
+};
+
+#endif
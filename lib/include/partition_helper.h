@@ -0,0 +1,30 @@
+#ifndef LIB_PLL_SMC_PARTITION_HELPER_H
+#define LIB_PLL_SMC_PARTITION_HELPER_H
+
+#include <string>
+#include <vector>
+
+#include "reference_partitions.h"
+
+/**
+   Parses a partition file in the RAxML-NG format for an alignment of
+   'column_count' columns. Every line has the form
+
+     MODEL, NAME = RANGE[, RANGE...]
+
+   where a range is a one-based column 'a', 'a-b' or 'a-b\s' taking every
+   s-th column. The model is 'JC', 'DNA' or 'GTR', which take optional
+   parameters as in 'GTR{1/2/1/1/2/1}', followed by optional '+G{alpha}' and
+   '+FC' (empirical), '+FE' (equal) or '+FU{a/c/g/t}' frequencies. Omitted
+   parameters keep the Jukes-Cantor defaults, so a bare 'GTR' has all
+   exchange rates 1 and is Jukes-Cantor. Without '+G' all sites evolve at
+   the same rate, a '+G' without parameters uses an alpha of 1. Empty lines
+   and lines starting with '#' are skipped.
+
+   Throws an std::runtime_error if the file can't be parsed or if partitions
+   overlap.
+ */
+std::vector<AlignmentPartition> parse_partitions(std::string file_path,
+                                                 unsigned int column_count);
+
+#endif
@@ -2,17 +2,39 @@
 #define PHYLO_FOREST_H
 
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
 #include <libpll/pll.h>
 
+#include "distance_matrix.h"
 #include "phylo_tree.h"
 #include "pll_buffer_manager.h"
+#include "reference_partitions.h"
+
+/**
+   A merge of roots 'i' and 'j' at 'height' whose edges have been created, but
+   whose pmatrices and parent node haven't been computed yet.
+ */
+struct PendingMerge {
+  int i;
+  int j;
+  double height;
+  std::shared_ptr<PhyloTreeEdge> edge_l;
+  std::shared_ptr<PhyloTreeEdge> edge_r;
+};
+
+/**
+   Outcome of a Metropolis-Hastings move. A move is NOT_PROPOSED if the
+   randomly picked part of the forest can't be changed by it.
+ */
+enum class MoveResult { NOT_PROPOSED, REJECTED, ACCEPTED };
 
 class PhyloForest {
-  const pll_partition_t *reference_partition;
+  const ReferencePartitions *reference_partitions;
   PLLBufferManager *const pll_buffer_manager;
+  const DistanceMatrix *distance_matrix;
 
   double forest_height;
   std::vector<std::shared_ptr<PhyloTreeNode>> roots;
@@ -29,15 +51,44 @@ class PhyloForest {
    */
   void remove_roots(int i, int j);
 
+  /**
+     Creates an edge from a node at 'height' to 'child'. The pmatrix buffer is
+     allocated but not computed.
+   */
+  std::shared_ptr<PhyloTreeEdge>
+  create_edge(std::shared_ptr<PhyloTreeNode> child, double height) const;
+
+  /**
+     Creates a new internal node at 'height' with the given children and
+     computes its pmatrices, CLV and log-likelihood. The root vector is left
+     unchanged.
+   */
+  std::shared_ptr<PhyloTreeNode>
+  create_node(std::shared_ptr<PhyloTreeNode> child_left,
+              std::shared_ptr<PhyloTreeNode> child_right, double height);
+
+  /**
+     Creates a new internal node at 'height' from edges whose pmatrices have
+     been built, and computes its CLV and log-likelihood. The CLV and
+     log-likelihood of the partitions' chunks are computed concurrently.
+   */
+  std::shared_ptr<PhyloTreeNode>
+  create_node(std::shared_ptr<PhyloTreeEdge> edge_left,
+              std::shared_ptr<PhyloTreeEdge> edge_right, double height);
+
 public:
   /**
      Creates a PhyloForest instance using a vector of pairs of (label, sequence)
      and a constant specifying a length of every sequence.
+
+     If a 'distance_matrix' of the sequences is given, the average distances
+     between its roots are available with 'root_distances'.
    */
   PhyloForest(const std::vector<std::pair<std::string, std::string>> sequences,
               const unsigned int sequence_lengths,
-              const pll_partition_t *reference_partition,
-              PLLBufferManager *const pll_buffer_manager);
+              const ReferencePartitions *reference_partitions,
+              PLLBufferManager *const pll_buffer_manager,
+              const DistanceMatrix *distance_matrix = nullptr);
 
   /**
      Copy constructor
@@ -73,6 +124,42 @@ public:
    */
   std::shared_ptr<PhyloTreeNode> connect(int i, int j, double height);
 
+  /**
+     First half of 'connect'. Creates the edges of a merge of roots 'i' and
+     'j' at 'height_delta' above the forest, without building their pmatrices.
+     The forest is left unchanged, so the pmatrices of the pending merges of
+     many forests can be built in one batch by 'build_pmatrices'.
+   */
+  PendingMerge prepare_connect(int i, int j, double height_delta) const;
+
+  /**
+     Second half of 'connect'. Completes a merge prepared by this forest once
+     the pmatrices of its edges have been built, and returns the new root.
+   */
+  std::shared_ptr<PhyloTreeNode> connect(const PendingMerge &merge);
+
+  /**
+     Builds the pmatrices of 'edges' from their lengths in one batch. The
+     edges may belong to other forests with the same reference partitions.
+   */
+  void build_pmatrices(const std::vector<PhyloTreeEdge *> &edges) const;
+
+  /**
+     Metropolis-Hastings move which perturbs the height of the most recent
+     merge. The waiting time since the previous merge is scaled by a random
+     factor and accepted according to its coalescent prior and the likelihood
+     of the merged tree. Not proposed while no merge has happened.
+   */
+  MoveResult rejuvenate_height(std::mt19937 &mt_generator);
+
+  /**
+     Metropolis-Hastings move which exchanges a subtree of a root's child with
+     the root's other child, keeping all heights. Only the two nodes on the
+     path to the root are recomputed. Not proposed if the picked root or
+     child is a leaf or the child is older than its sibling.
+   */
+  MoveResult rejuvenate_exchange(std::mt19937 &mt_generator);
+
   /**
      Computes the likelihood factor (see equation 2.31)
    */
@@ -85,6 +172,53 @@ public:
     return roots;
   }
 
+  /**
+     Returns true if the forest keeps track of distances between its roots.
+   */
+  bool has_root_distances() const { return distance_matrix; }
+
+  /**
+     Returns the distance matrix of the forest's sequences, if any.
+   */
+  const DistanceMatrix *get_distance_matrix() const { return distance_matrix; }
+
+  /**
+     Returns the reference partitions of the forest's sequences.
+   */
+  const ReferencePartitions *get_reference_partitions() const {
+    return reference_partitions;
+  }
+
+  /**
+     Returns the buffer manager of the forest's nodes.
+   */
+  PLLBufferManager *get_buffer_manager() const { return pll_buffer_manager; }
+
+  /**
+     Index of the root above every sequence, found by walking all trees once
+     in O(number of sequences). Requires a distance matrix.
+   */
+  std::vector<unsigned int> sequence_roots() const;
+
+  /**
+     Average distances between the leaves of root 'k' and the leaves of every
+     root, zero for root 'k' itself, given the 'sequence_roots' of the
+     current roots. Computed from the distance matrix in O(number of leaves
+     of 'k' times number of sequences). A proposal needs this for two roots,
+     so with thousands of sequences it costs up to a few million distance
+     lookups once the roots are large, but far fewer in early iterations.
+   */
+  std::vector<double>
+  root_distances(const unsigned int k,
+                 const std::vector<unsigned int> &sequence_roots) const;
+
+  /**
+     Same as above, finding the 'sequence_roots' first.
+   */
+  std::vector<double> root_distances(const unsigned int k) const {
+    return root_distances(k, sequence_roots());
+  }
+
   /**
      Number of root nodes in the forrest.
    */
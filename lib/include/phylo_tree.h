@@ -2,6 +2,7 @@
 #define LIB_PLL_SMC_PHYLO_TREE_H
 
 #include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 #include <cstring>
@@ -43,6 +44,12 @@ public:
 /**
    A node in a PhyloTree is either a leaf or points to two edges. A node also
    keeps track of a PLL clv buffer and a scale buffer.
+
+   Depending on the precision of the 'manager' the clv is either stored in
+   'clv' or, in single precision, in 'clv_single'. The other pointer is null,
+   as are both for leaves.
+   Single precision clvs are normalized per scaling block and the scale buffer
+   then counts powers of two rather than multiples of PLL_SCALE_THRESHOLD.
  */
 class PhyloTreeNode {
 
@@ -51,10 +58,17 @@ class PhyloTreeNode {
    */
   PLLBufferManager *manager;
 
+  /**
+     Returns the clv buffer of an inner node to the 'manager'.
+   */
+  void return_clv();
+
 public:
   /**
-     Constructs a node. Attempts to re-use an exiting clv buffer and scale
-     buffer from the 'manager'.
+     Constructs an inner node. Attempts to re-use an exiting clv buffer and
+     scale buffer from the 'manager'. The 'clv_size' is given in bytes of a
+     double precision clv. If a buffer can't be acquired within the memory
+     budget, the buffers acquired so far are returned before rethrowing.
    */
   PhyloTreeNode(PLLBufferManager *manager,
                 std::shared_ptr<PhyloTreeEdge> edge_l,
@@ -62,9 +76,16 @@ public:
                 double height, unsigned int clv_size,
                 unsigned int scale_buffer_size);
 
+  /**
+     Constructs a leaf node for the sequence 'tip_index'. Leaf nodes own no
+     buffers, their clvs are the tip clvs of the reference partitions.
+   */
+  PhyloTreeNode(PLLBufferManager *manager, std::string label,
+                unsigned int tip_index);
+
   /**
      Destroys the node and adds the clv buffer and scale buffer to the
-     'manager'.
+     'manager'. Leaf nodes don't own their buffers and recycle nothing.
    */
   ~PhyloTreeNode();
 
@@ -75,8 +96,27 @@ public:
   double height;
   double ln_likelihood;
 
+  /**
+     Creation number of the node, larger for nodes created later.
+   */
+  unsigned long id;
+
+  /**
+     Number of leaves below the node, and for leaves the index of their
+     sequence.
+   */
+  unsigned int leaf_count;
+  unsigned int tip_index;
+
   double *clv;
+  float *clv_single;
   unsigned int *scale_buffer;
 };
 
+/**
+   Writes the tree rooted at 'root' to 'stream' in Newick format, without the
+   terminating semicolon.
+ */
+void print_tree(std::shared_ptr<PhyloTreeNode> root, std::ostream &stream);
+
 #endif
@@ -1,15 +1,137 @@
 #ifndef LIB_PLL_SMC_PLL_BUFFER_MANAGER_H
 #define LIB_PLL_SMC_PLL_BUFFER_MANAGER_H
 
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <stack>
 
+#include "memory_account.h"
+
+/**
+   Storage precision of inner node CLV buffers. Tip CLVs are owned by the
+   reference partition and are always stored in double precision.
+ */
+enum class CLVPrecision { DOUBLE, SINGLE };
+
+/**
+   A stack of unused buffers which all have the same size.
+ */
+template <typename T> struct BufferStack {
+  std::stack<T *> buffers;
+
+  /**
+     Size in bytes of every buffer, set when the first buffer is acquired.
+   */
+  size_t buffer_size = 0;
+};
+
 /**
-   A struct which keeps track of allocated but unused PLL data buffers.
+   A struct which keeps track of allocated but unused PLL data buffers. The
+   buffer stacks are shared between threads and must only be accessed while
+   holding 'mutex'.
+
+   Every allocation is recorded in 'memory_account'. If a new buffer would
+   exceed the account's budget the pooled buffers of all managers recording in
+   the account are freed first. If that is
+   not enough an std::runtime_error is thrown, unless the account allows
+   degrading, in which case new CLVs are stored in single precision from then
+   on and the account records the degradation.
  */
 struct PLLBufferManager {
-  std::stack<double *> clv_buffer;
-  std::stack<double *> pmatrix_buffer;
-  std::stack<unsigned int *> scale_buffer_buffer;
+  std::atomic<CLVPrecision> clv_precision;
+  std::mutex mutex;
+
+  BufferStack<double> clv_buffer;
+  BufferStack<float> clv_single_buffer;
+  BufferStack<double> pmatrix_buffer;
+  BufferStack<unsigned int> scale_buffer_buffer;
+
+  /**
+     The account to record allocations in. Defaults to an account owned by the
+     manager, and may be shared by several managers to give them a common
+     budget. Changed with 'set_memory_account'.
+   */
+  MemoryAccount *memory_account;
+
+  PLLBufferManager();
+  PLLBufferManager(const PLLBufferManager &) = delete;
+  PLLBufferManager &operator=(const PLLBufferManager &) = delete;
+
+  /**
+     Frees all pooled buffers. Buffers still in use by nodes or edges must not
+     be returned to the manager after it has been destroyed.
+   */
+  ~PLLBufferManager();
+
+  /**
+     Pops a buffer from 'stack' and zeroes it, or allocates a new buffer of
+     'size' bytes if the stack is empty.
+   */
+  template <typename T>
+  T *acquire(BufferStack<T> &stack, MemoryCategory category, size_t size) {
+    T *buffer = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      assert((stack.buffer_size == 0 || stack.buffer_size == size) &&
+             "Buffers of a stack must have the same size");
+      stack.buffer_size = size;
+
+      if (!stack.buffers.empty()) {
+        buffer = stack.buffers.top();
+        stack.buffers.pop();
+        memory_account->reuse(category, size);
+      }
+    }
+
+    if (!buffer) {
+      reserve(category, size);
+      return (T *)std::malloc(size);
+    }
+
+    std::memset(buffer, 0, size);
+    return buffer;
+  }
+
+  /**
+     Pushes an acquired buffer back onto 'stack' for reuse.
+   */
+  template <typename T>
+  void recycle(BufferStack<T> &stack, MemoryCategory category, T *buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stack.buffers.push(buffer);
+    memory_account->pool(category, stack.buffer_size);
+  }
+
+  /**
+     Frees an acquired buffer instead of keeping it for reuse.
+   */
+  template <typename T>
+  void release(BufferStack<T> &stack, MemoryCategory category, T *buffer) {
+    std::free(buffer);
+    memory_account->release(category, stack.buffer_size);
+  }
+
+  /**
+     Frees all pooled buffers.
+   */
+  void free_pooled_buffers();
+
+  /**
+     Records allocations in 'account' from now on. Must be called before the
+     first buffer is acquired.
+   */
+  void set_memory_account(MemoryAccount *account);
+
+private:
+  MemoryAccount own_account;
+
+  /**
+     Records a new allocation of 'size' bytes, enforcing the budget.
+   */
+  void reserve(MemoryCategory category, size_t size);
 };
 
 #endif
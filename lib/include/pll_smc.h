@@ -5,35 +5,165 @@
 #include <libpll/pll.h>
 
 #include <iostream>
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
 
+#include "distance_matrix.h"
 #include "particle.h"
+#include "particle_population.h"
 #include "phylo_tree.h"
+#include "reference_partitions.h"
+#include "thread_pool.h"
+
+class SMCEngine;
+
+/**
+   Options for a run of the Sequential Monte Carlo algorithm.
+ */
+struct SMCOptions {
+  /**
+     Storage precision of inner node CLVs. Single precision halves the CLV
+     memory, root log-likelihoods are still accumulated in double precision.
+   */
+  CLVPrecision clv_precision = CLVPrecision::DOUBLE;
+
+  /**
+     Number of Metropolis-Hastings moves applied to every particle after
+     resampling. Zero disables rejuvenation.
+   */
+  unsigned int rejuvenation_moves = 0;
+
+  /**
+     Propose pairs of roots with probability decreasing with their average
+     pairwise sequence distance instead of uniformly.
+   */
+  bool distance_proposal = false;
+
+  /**
+     Target ESS of every generation. If non-zero the number of particles is
+     clamped to the bounds below and adapted after every iteration, within
+     them, so that the next generation is expected to reach the target. The
+     count changes by at most a factor of two per iteration, and if the
+     bounds cross the maximum wins. Particles are resampled every iteration,
+     so this is also a target for the conditional ESS.
+   */
+  double target_ess = 0.0;
+  unsigned int min_particle_count = 100;
+  unsigned int max_particle_count = 100000;
+
+  /**
+     Budget in bytes for CLVs, scale buffers, pmatrices, nodes, edges and
+     particles, pooled buffers included. Zero disables the budget. Exceeding
+     the budget throws an std::runtime_error.
+   */
+  size_t memory_budget = 0;
+
+  /**
+     Store new CLVs in single precision when memory use gets close to the
+     budget instead of running into it.
+   */
+  bool degrade_on_memory_budget = false;
+
+  /**
+     Number of worker threads. Zero uses one thread per hardware thread.
+   */
+  unsigned int thread_count = 0;
+
+  /**
+     Spread the threads over the machine's NUMA nodes and pin them. Every
+     node gets its own buffer pools and shard of particles. A non-zero
+     'fake_numa_nodes' enables the mode with the CPUs split into that many
+     nodes, for testing on machines with a single node.
+   */
+  bool numa = false;
+  unsigned int fake_numa_nodes = 0;
+
+  /**
+     Write progress information such as the ESS and peak memory use of every
+     iteration to stderr.
+   */
+  bool progress = true;
+};
 
 /**
-   Runs the Sequential Monte Carlo algorithm with a number of particles. Returns
-   the resulting particles.
+   Returns the NUMA topology to use for the thread pool according to the
+   options. The topology is empty unless the NUMA-aware mode is enabled.
  */
-std::vector<Particle *>
+NumaTopology numa_topology(const SMCOptions &options);
+
+/**
+   Runs the Sequential Monte Carlo algorithm with a number of particles. Each
+   of the 'partitions' of the alignment has its own model, without partitions
+   the whole alignment uses a single Jukes-Cantor model. Returns the engine
+   which ran the job, owning the final generation of particles and their
+   buffers, see 'SMCEngine::get_particles'. Destroying the engine frees them.
+ */
+std::unique_ptr<SMCEngine>
 run_smc(const unsigned int particle_count,
-        const std::vector<std::pair<std::string, std::string>> sequences);
+        const std::vector<std::pair<std::string, std::string>> sequences,
+        const SMCOptions &options = SMCOptions(),
+        const std::vector<AlignmentPartition> &partitions = {});
+
+/**
+   Validates single precision CLV storage against double precision storage by
+   building 'trial_count' random trees over the sequences with both. Returns
+   the largest absolute difference between the log-likelihoods of any node.
+ */
+double validate_single_precision(
+    const std::vector<std::pair<std::string, std::string>> sequences,
+    const unsigned int trial_count,
+    const std::vector<AlignmentPartition> &partitions = {});
+
+/**
+   Runs one fused SMC iteration, resampling 'next_generation.size()' particles
+   from 'generation'. Ancestors are drawn up front, after which each thread
+   copies, rejuvenates and proposes a contiguous block of particles in a single
+   pass while accumulating the block's log-sum-exp of the new weights. The
+   proposals of a block are made in small batches whose pmatrices are built
+   together (see Particle::propose_all). The
+   blocks are then combined and the weights normalized with a single exp per
+   particle.
+
+   If shard offsets of the generations are given (see ParticlePopulation),
+   shard k is processed by the threads of NUMA node k of the 'thread_pool'.
+   Offspring are placed in the shard of their ancestor and only move to
+   another shard if the ancestor's shard has no free slots left.
+
+   Returns the ESS of the new generation.
+ */
+double iterate(const std::vector<Particle *> &generation,
+               std::vector<Particle *> &next_generation,
+               const SMCOptions &options, ThreadPool &thread_pool,
+               const std::vector<unsigned int> &generation_shards = {},
+               const std::vector<unsigned int> &next_generation_shards = {});
 
 /**
-   Resamples the particles based on their weights using multinomial resampling.
+   Places the sorted 'ancestors' into the slots of the next generation's
+   shards. Offspring stay in the shard of their ancestor while it has free
+   slots, the remaining offspring fill the free slots of other shards.
+   Returns the number of offspring placed in another shard.
  */
-void resample(std::vector<Particle *> &particles, const unsigned int iteration);
+unsigned int
+place_offspring(std::vector<unsigned int> &ancestors,
+                const std::vector<unsigned int> &generation_shards,
+                const std::vector<unsigned int> &next_generation_shards);
 
 /**
-   Proposes an update to a partical using the particals proposal method.
+   Returns the number of particles to use for the next generation given the
+   size and ESS of the current one. Without an ESS target the count is
+   unchanged.
  */
-void propose(std::vector<Particle *> &particles, const unsigned int iteration);
+unsigned int adapt_particle_count(const unsigned int count, const double ess,
+                                  const SMCOptions &options);
 
 /**
-   Normalizes the weight of the particle.
+   Returns the number of particles of the first generation for the requested
+   'count', which is clamped to the particle count bounds if there is an ESS
+   target.
  */
-void normalize_weights(std::vector<Particle *> &particles,
-                       const unsigned int iteration);
+unsigned int initial_particle_count(const unsigned int count,
+                                    const SMCOptions &options);
 
 #endif
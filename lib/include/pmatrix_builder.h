@@ -0,0 +1,64 @@
+#ifndef LIB_PLL_SMC_PMATRIX_BUILDER_H
+#define LIB_PLL_SMC_PMATRIX_BUILDER_H
+
+#include <vector>
+
+#include <libpll/pll.h>
+
+/**
+   Builds the pmatrices of many branch lengths at once from the
+   eigendecompositions of a set of PLL partitions.
+
+   The eigenvalues of every partition are scaled by the rates of its rate
+   categories once, so that building a pmatrix only takes the exponentials
+   and two small matrix products. The exponentials of all edges of a batch
+   are computed together by 'exp_in_place', with SSE2 where available.
+
+   Pmatrices are laid out as by pll_core_update_pmatrix, one after another
+   for every partition.
+ */
+class PMatrixBuilder {
+  unsigned int states;
+  unsigned int states_padded;
+  unsigned int rate_cats;
+  unsigned int partition_count;
+
+  /**
+     Eigenvalues times category rate for every partition and rate category,
+     divided by the share of variable sites if there are invariant sites.
+   */
+  std::vector<double> scaled_eigenvals;
+
+  /**
+     Eigenvectors and inverse eigenvectors of every partition.
+   */
+  std::vector<double> eigenvecs;
+  std::vector<double> inv_eigenvecs;
+
+public:
+  PMatrixBuilder();
+
+  /**
+     Copies the eigendecompositions of 'partitions', which must all have the
+     same number of states and rate categories and a single set of model
+     parameters. Later changes to the models of 'partitions' aren't seen by
+     the builder.
+   */
+  PMatrixBuilder(const std::vector<pll_partition_t *> &partitions);
+
+  /**
+     Number of doubles written to each pmatrix buffer.
+   */
+  unsigned int pmatrix_length() const {
+    return partition_count * rate_cats * states * states_padded;
+  }
+
+  /**
+     Writes the pmatrices of every partition for branch length 'lengths[e]'
+     into 'pmatrices[e]', for each of the 'count' edges.
+   */
+  void build(const double *lengths, double *const *pmatrices,
+             const unsigned int count) const;
+};
+
+#endif
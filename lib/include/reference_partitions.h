@@ -0,0 +1,184 @@
+#ifndef LIB_PLL_SMC_REFERENCE_PARTITIONS_H
+#define LIB_PLL_SMC_REFERENCE_PARTITIONS_H
+
+#include <string>
+#include <vector>
+
+#include <libpll/pll.h>
+
+#include "pmatrix_builder.h"
+#include "thread_pool.h"
+
+/**
+   A set of alignment columns, such as a gene, together with the parameters of
+   its substitution model.
+ */
+struct AlignmentPartition {
+  std::string name;
+
+  /**
+     Zero-based alignment columns of the partition.
+   */
+  std::vector<unsigned int> columns;
+
+  /**
+     GTR exchange rates in the order AC, AG, AT, CG, CT, GT.
+   */
+  double subst_params[6] = {1, 1, 1, 1, 1, 1};
+
+  /**
+     Equilibrium frequencies of A, C, G and T. If 'empirical_frequencies' is
+     set they are instead counted in the partition's columns.
+   */
+  double frequencies[4] = {0.25, 0.25, 0.25, 0.25};
+  bool empirical_frequencies = false;
+
+  /**
+     Use four discrete gamma rate categories of shape 'gamma_alpha' for rate
+     heterogeneity across sites. Otherwise the four categories all have rate
+     1, so every partition keeps the same number of categories.
+   */
+  bool gamma_rates = false;
+  double gamma_alpha = 1.0;
+};
+
+/**
+   Returns a single Jukes-Cantor partition with gamma rates of shape 1
+   covering 'column_count' columns.
+ */
+std::vector<AlignmentPartition>
+default_partitions(const unsigned int column_count);
+
+/**
+   The reference PLL partitions of an alignment, one per AlignmentPartition.
+   Each holds the tip CLVs of its columns and its own model.
+
+   Node CLVs and scale buffers store the sites of all partitions after each
+   other, and edge pmatrix buffers store one pmatrix per partition. All
+   partitions use the same number of states and rate categories, so a site
+   takes the same space in every partition.
+
+   The models of the partitions are fixed at construction. Their pmatrices
+   are built from a copy of the eigendecompositions, and the partitions are
+   only handed out as const.
+
+   The sites are also split into chunks of at most one partition each, which
+   are grouped into tasks of roughly equal site count. Large partitions are
+   split over several tasks and small ones share a task, so that computing a
+   node's likelihood in parallel isn't held up by the largest partition.
+ */
+class ReferencePartitions {
+public:
+  /**
+     A range [begin, end) of the sites of a partition.
+   */
+  struct Chunk {
+    unsigned int partition;
+    unsigned int begin;
+    unsigned int end;
+  };
+
+private:
+  std::vector<pll_partition_t *> partitions;
+  std::vector<unsigned int> site_offsets;
+  unsigned int site_count;
+  PMatrixBuilder pmatrix_builder;
+
+  std::vector<std::vector<Chunk>> tasks;
+  ThreadPool *thread_pool;
+
+public:
+  /**
+     Creates a partition for each of 'alignment_partitions' from the columns of
+     'sequences'. An empty vector uses 'default_partitions'. If a
+     'thread_pool' is given, the tasks of 'for_each_chunk' run on it.
+   */
+  ReferencePartitions(
+      const std::vector<std::pair<std::string, std::string>> &sequences,
+      std::vector<AlignmentPartition> alignment_partitions,
+      ThreadPool *thread_pool = nullptr);
+
+  /**
+     Destroys the PLL partitions.
+   */
+  ~ReferencePartitions();
+
+  ReferencePartitions(const ReferencePartitions &) = delete;
+  ReferencePartitions &operator=(const ReferencePartitions &) = delete;
+
+  unsigned int partition_count() const { return partitions.size(); }
+  const pll_partition_t *get_partition(unsigned int i) const {
+    return partitions[i];
+  }
+
+  /**
+     Index of the first site of partition 'i' in node buffers.
+   */
+  unsigned int site_offset(unsigned int i) const { return site_offsets[i]; }
+
+  /**
+     Number of doubles and scale buffer entries used per site.
+   */
+  unsigned int site_clv_length() const {
+    return partitions[0]->states_padded * partitions[0]->rate_cats;
+  }
+  unsigned int site_scaler_length() const {
+    return (partitions[0]->attributes & PLL_ATTRIB_RATE_SCALERS)
+               ? partitions[0]->rate_cats
+               : 1;
+  }
+
+  /**
+     Number of doubles of a node CLV, entries of a node scale buffer and
+     doubles of an edge pmatrix buffer, covering all partitions.
+   */
+  unsigned int clv_length() const { return site_count * site_clv_length(); }
+  unsigned int scaler_length() const {
+    return site_count * site_scaler_length();
+  }
+  unsigned int partition_pmatrix_length() const {
+    return partitions[0]->states * partitions[0]->states_padded *
+           partitions[0]->rate_cats;
+  }
+  unsigned int pmatrix_length() const {
+    return partitions.size() * partition_pmatrix_length();
+  }
+
+  /**
+     Builds the edge pmatrices of all partitions.
+   */
+  const PMatrixBuilder &get_pmatrix_builder() const { return pmatrix_builder; }
+
+  /**
+     Tip CLV of sequence 'tip_index' in partition 'i'.
+   */
+  const double *tip_clv(unsigned int tip_index, unsigned int i) const {
+    return partitions[i]->clv[tip_index];
+  }
+
+  /**
+     Number of tasks 'for_each_chunk' splits its work into.
+   */
+  unsigned int task_count() const { return tasks.size(); }
+
+  /**
+     Calls 'function(task, chunk)' for every chunk, running the tasks
+     concurrently if there is a thread pool. The chunks of a task run in the
+     same thread one after another.
+   */
+  template <typename Function> void for_each_chunk(Function function) const {
+    auto run_task = [this, &function](unsigned int task) {
+      for (auto &chunk : tasks[task])
+        function(task, chunk);
+    };
+
+    if (!thread_pool || tasks.size() == 1) {
+      for (unsigned int task = 0; task < tasks.size(); task++)
+        run_task(task);
+    } else {
+      thread_pool->parallel_for(0, tasks.size(), run_task);
+    }
+  }
+};
+
+#endif
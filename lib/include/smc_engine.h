@@ -0,0 +1,184 @@
+#ifndef LIB_PLL_SMC_SMC_ENGINE_H
+#define LIB_PLL_SMC_SMC_ENGINE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "pll_smc.h"
+#include "thread_pool.h"
+
+/**
+   A tree of the final particle population together with its weights.
+ */
+struct SMCTree {
+  double weight;
+  double normalized_weight;
+  std::string newick;
+};
+
+/**
+   A long-lived SMC engine which can process many alignments. The thread pool
+   and the PLL buffer pools are kept between jobs so that only the first job
+   pays for thread creation, and jobs with the buffer sizes of the previous
+   one don't allocate buffers anew.
+
+   In NUMA-aware mode every node has its own buffer pools and each job keeps
+   a shard of its particles on every node.
+
+   A single job is run step-wise with 'init', 'step' and 'finish', or at once
+   with 'run'. Many independent alignments can be run concurrently on the same
+   worker threads with 'run_batch'.
+ */
+class SMCEngine {
+  /**
+     The state of one alignment being processed.
+   */
+  struct Job {
+    ReferencePartitions *reference_partitions = nullptr;
+    std::vector<PLLBufferManager *> pll_buffer_managers;
+    const DistanceMatrix *distance_matrix = nullptr;
+    ParticlePopulation *population = nullptr;
+
+    unsigned int iteration = 0;
+    unsigned int iterations = 0;
+    unsigned int next_particle_count = 0;
+  };
+
+  SMCOptions options;
+  ThreadPool thread_pool;
+
+  /**
+     Memory use of all jobs, shared by the buffer pools so that the memory
+     budget covers the whole engine.
+   */
+  MemoryAccount memory_account;
+
+  /**
+     A buffer pool together with the number of running jobs using it.
+   */
+  struct BufferPool {
+    std::unique_ptr<PLLBufferManager> manager;
+    unsigned int job_count = 0;
+  };
+
+  /**
+     Buffer pools keyed by the CLV and pmatrix lengths and the NUMA node.
+     Pools are shared by all jobs whose buffers have the same sizes. Once no
+     running job uses a pool it is only kept until a job with other sizes
+     finishes, so that alignments of many different lengths don't pile up
+     pooled buffers.
+   */
+  std::map<std::tuple<unsigned int, unsigned int, unsigned int>, BufferPool>
+      buffer_pools;
+  std::mutex buffer_pools_mutex;
+
+  Job job;
+
+  /**
+     Returns the buffer pool of NUMA node 'node' used for partitions shaped
+     like 'partitions', counting the calling job as one of its users.
+   */
+  PLLBufferManager *buffer_manager(const ReferencePartitions &partitions,
+                                   const unsigned int node);
+
+  /**
+     Gives up the pools 'managers' of a finished job. Pools without jobs are
+     freed, except for 'managers' themselves, which are kept for a following
+     job of the same sizes.
+   */
+  void release_buffer_managers(const std::vector<PLLBufferManager *> &managers);
+
+  /**
+     Implementations of 'init', 'step' and 'finish' for any job, used both for
+     the engine's own job and for batch jobs.
+   */
+  void init_job(Job &job, const unsigned int particle_count,
+                const std::vector<std::pair<std::string, std::string>> sequences,
+                const std::vector<AlignmentPartition> &partitions,
+                const SMCOptions &job_options);
+  bool step_job(Job &job, const SMCOptions &job_options);
+  std::vector<SMCTree> finish_job(Job &job);
+
+public:
+  /**
+     Creates an engine with the given options and starts its worker threads.
+   */
+  explicit SMCEngine(const SMCOptions &options);
+
+  /**
+     Frees the current job, if any, and all pooled buffers.
+   */
+  ~SMCEngine();
+
+  SMCEngine(const SMCEngine &) = delete;
+  SMCEngine &operator=(const SMCEngine &) = delete;
+
+  /**
+     Starts a job for the sequences using 'particle_count' particles. Each of
+     the 'partitions' of the alignment has its own model, without partitions
+     a single Jukes-Cantor model is used. An unfinished previous job is
+     discarded.
+   */
+  void init(const unsigned int particle_count,
+            const std::vector<std::pair<std::string, std::string>> sequences,
+            const std::vector<AlignmentPartition> &partitions = {});
+
+  /**
+     Runs one iteration of the current job. Returns false once all iterations
+     have been run.
+   */
+  bool step();
+
+  /**
+     Returns the trees of the final particle population of the current job and
+     releases the job's particles and partition. Their buffers stay pooled in
+     the engine for the next job.
+   */
+  std::vector<SMCTree> finish();
+
+  /**
+     Runs a whole job, equivalent to 'init', 'step' until done and 'finish'.
+   */
+  std::vector<SMCTree>
+  run(const unsigned int particle_count,
+      const std::vector<std::pair<std::string, std::string>> sequences,
+      const std::vector<AlignmentPartition> &partitions = {});
+
+  /**
+     Runs one job for every alignment, using the partitions of the same index
+     if 'partitions' is not empty. Jobs are scheduled concurrently onto the
+     worker threads and their per-iteration work shares the same threads.
+     Progress output is disabled for batch jobs. Returns the results in the
+     order of 'alignments'. If a job throws, the first exception is rethrown
+     once all jobs have finished.
+   */
+  std::vector<std::vector<SMCTree>> run_batch(
+      const unsigned int particle_count,
+      const std::vector<std::vector<std::pair<std::string, std::string>>>
+          &alignments,
+      const std::vector<std::vector<AlignmentPartition>> &partitions = {});
+
+  /**
+     Returns the current generation of particles of the current job.
+   */
+  std::vector<Particle *> get_particles() const {
+    return job.population ? job.population->get_generation()
+                          : std::vector<Particle *>();
+  }
+
+  /**
+     Number of iterations run so far in the current job.
+   */
+  unsigned int get_iteration() const { return job.iteration; }
+
+  /**
+     Memory use of the engine's particles and buffer pools.
+   */
+  const MemoryAccount &get_memory_account() const { return memory_account; }
+};
+
+#endif
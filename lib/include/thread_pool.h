@@ -0,0 +1,250 @@
+#ifndef LIB_PLL_SMC_THREAD_POOL_H
+#define LIB_PLL_SMC_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa_topology.h"
+
+/**
+   Returns 'thread_count', or the number of hardware threads if it is zero.
+ */
+inline unsigned int resolve_thread_count(const unsigned int thread_count) {
+  if (thread_count > 0)
+    return thread_count;
+
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+   A fixed set of worker threads executing submitted tasks. Every task belongs
+   to the group of tasks counted by a 'pending' counter. Threads waiting for a
+   group to finish run the queued tasks of that group meanwhile, so tasks may
+   themselves submit and wait for tasks without deadlocking, and a waiting
+   thread never runs unrelated tasks nested on its stack.
+
+   The threads are spread evenly over the nodes of a NUMA topology and pinned
+   to their node's CPUs. Every node has its own task queue. Threads run the
+   tasks of their own node first and only take tasks of another node when no
+   thread of that node is idle or already woken to run them.
+ */
+class ThreadPool {
+  NumaTopology topology;
+
+  std::vector<std::thread> workers;
+  std::vector<unsigned int> node_thread_counts;
+
+  struct Task {
+    std::function<void()> function;
+    const std::atomic<unsigned int> *group;
+  };
+
+  std::vector<std::deque<Task>> tasks;
+
+  /**
+     Number of workers of every node waiting for tasks, and of those woken by
+     'submit' which haven't taken a task yet.
+   */
+  std::vector<unsigned int> idle_workers;
+  std::vector<unsigned int> woken_workers;
+
+  std::mutex mutex;
+  std::vector<std::condition_variable> task_available;
+  std::condition_variable task_finished;
+  bool stopping;
+
+  /**
+     The thread which created the pool and its CPUs before it was pinned.
+   */
+  std::thread::id creator;
+  std::vector<unsigned int> creator_cpus;
+
+  /**
+     Node of the calling thread, zero for threads outside of any pool.
+   */
+  static thread_local unsigned int thread_node;
+
+  /**
+     Main loop of the worker threads of 'node'.
+   */
+  void work(const unsigned int node);
+
+  /**
+     Returns true if threads of other nodes may take tasks queued for 'node',
+     which is the case if it has no idle workers and more tasks than woken
+     workers. Requires holding 'mutex'.
+   */
+  bool stealable(const unsigned int node) const {
+    return idle_workers[node] == 0 && tasks[node].size() > woken_workers[node];
+  }
+
+  /**
+     Pops a task of 'group', or of any group if it is null, from the queue of
+     'node' or else from a stealable queue. Returns false if there is no such
+     task. Requires holding 'mutex'.
+   */
+  bool pop_task(const unsigned int node,
+                const std::atomic<unsigned int> *group,
+                std::function<void()> &task);
+
+  /**
+     Runs one queued task of 'group' in the calling thread. Returns false if
+     there was no such task.
+   */
+  bool run_pending_task(const std::atomic<unsigned int> &group);
+
+  /**
+     Wakes threads blocked in 'wait' after a task has finished.
+   */
+  void notify_finished();
+
+public:
+  /**
+     Creates a pool using 'thread_count' threads including the thread calling
+     'parallel_for' or 'wait'. A thread count of zero uses one thread per
+     hardware thread.
+
+     With a non-empty 'topology' the calling thread counts as a thread of the
+     first node and is pinned as well until the pool is destroyed. If there
+     are fewer threads than nodes, only the first nodes are used.
+   */
+  explicit ThreadPool(const unsigned int thread_count,
+                      const NumaTopology &topology = NumaTopology());
+
+  /**
+     Finishes all queued tasks and joins the worker threads. If the creating
+     thread destroys the pool, its CPUs from before the pool are restored.
+   */
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+     Number of threads used by the pool, including the calling thread.
+   */
+  unsigned int size() const { return workers.size() + 1; }
+
+  /**
+     Number of NUMA nodes used by the pool, and the number of threads of
+     'node'.
+   */
+  unsigned int node_count() const { return node_thread_counts.size(); }
+  unsigned int node_size(const unsigned int node) const {
+    return node_thread_counts[node];
+  }
+
+  /**
+     Queues a task of the group counted by 'pending' for execution by any
+     thread of the pool, preferably one of the calling thread's node. The task
+     must decrement 'pending' when done.
+   */
+  void submit(std::function<void()> task,
+              const std::atomic<unsigned int> &pending);
+
+  /**
+     Queues a task of the group counted by 'pending' for execution by a thread
+     of 'node'. Threads of other nodes only run it if all threads of 'node'
+     are busy.
+   */
+  void submit(std::function<void()> task,
+              const std::atomic<unsigned int> &pending,
+              const unsigned int node);
+
+  /**
+     Blocks until 'pending' reaches zero, running queued tasks of its group
+     meanwhile.
+   */
+  void wait(const std::atomic<unsigned int> &pending);
+
+  /**
+     Calls 'function' for every index in [begin, end). The range is split into
+     one contiguous block per thread and the calling thread runs the first
+     block itself. If 'function' throws, the first exception is rethrown once
+     all blocks have finished.
+   */
+  template <typename Function>
+  void parallel_for(const unsigned int begin, const unsigned int end,
+                    Function function) {
+    if (end <= begin)
+      return;
+
+    const unsigned int block_count = std::min(size(), end - begin);
+    const unsigned int block_size =
+        (end - begin + block_count - 1) / block_count;
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto run_block = [begin, end, block_size, &function, &error,
+                      &error_mutex](unsigned int block) {
+      try {
+        for (unsigned int i = begin + block * block_size;
+             i < std::min(end, begin + (block + 1) * block_size); i++)
+          function(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    };
+
+    std::atomic<unsigned int> pending(block_count - 1);
+    for (unsigned int block = 1; block < block_count; block++) {
+      submit(
+          [&run_block, &pending, block]() {
+            run_block(block);
+            pending--;
+          },
+          pending);
+    }
+
+    run_block(0);
+    wait(pending);
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  /**
+     Calls 'function(i)' as a task on node 'nodes[i]' for every index of
+     'nodes' and waits for all of them. If 'function' throws, the first
+     exception is rethrown once all tasks have finished.
+   */
+  template <typename Function>
+  void run_on_nodes(const std::vector<unsigned int> &nodes,
+                    Function function) {
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    std::atomic<unsigned int> pending(nodes.size());
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+      submit(
+          [&function, &pending, &error, &error_mutex, i]() {
+            try {
+              function(i);
+            } catch (...) {
+              std::lock_guard<std::mutex> lock(error_mutex);
+              if (!error)
+                error = std::current_exception();
+            }
+            pending--;
+          },
+          pending, nodes[i]);
+    }
+
+    wait(pending);
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+#endif
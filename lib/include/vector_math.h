@@ -0,0 +1,15 @@
+#ifndef LIB_PLL_SMC_VECTOR_MATH_H
+#define LIB_PLL_SMC_VECTOR_MATH_H
+
+/**
+   Replaces every entry of 'values' by its exponential.
+
+   Uses x = n ln(2) + r with |r| <= ln(2) / 2 and a degree 12 Taylor
+   polynomial for exp(r), accurate to about one ulp. With SSE2, four values
+   are computed at a time in two independent vectors. Arguments are clamped
+   to the range of normal doubles, so results below it become tiny instead of
+   zero.
+ */
+void exp_in_place(double *values, const unsigned int count);
+
+#endif
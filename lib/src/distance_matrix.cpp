@@ -0,0 +1,85 @@
+#include "distance_matrix.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <libpll/pll.h>
+
+/**
+   Packs a sequence into 64 bit words of sixteen 4 bit state sets. Unknown
+   characters and the padding of the last word match every state.
+ */
+std::vector<uint64_t> encode_sequence(const std::string &sequence) {
+  std::vector<uint64_t> words((sequence.length() + 15) / 16, ~0ULL);
+
+  for (unsigned int s = 0; s < sequence.length(); s++) {
+    uint64_t states = pll_map_nt[(unsigned char)sequence[s]] & 0xF;
+    if (states == 0)
+      states = 0xF;
+
+    const unsigned int shift = 4 * (s % 16);
+    words[s / 16] &= ~(0xFULL << shift);
+    words[s / 16] |= states << shift;
+  }
+
+  return words;
+}
+
+/**
+   Counts the sites whose state sets don't intersect.
+ */
+unsigned int count_mismatches(const uint64_t *a, const uint64_t *b,
+                              const unsigned int word_count) {
+  const uint64_t nibble_low_bits = 0x1111111111111111ULL;
+
+  unsigned int matches = 0;
+  for (unsigned int w = 0; w < word_count; w++) {
+    // Fold every nibble onto its lowest bit.
+    uint64_t shared = a[w] & b[w];
+    shared |= shared >> 1;
+    shared |= shared >> 2;
+
+    matches += __builtin_popcountll(shared & nibble_low_bits);
+  }
+
+  return word_count * 16 - matches;
+}
+
+DistanceMatrix::DistanceMatrix(
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    ThreadPool &thread_pool)
+    : sequence_count(sequences.size()),
+      site_count(sequences[0].second.length()),
+      distances(sequences.size() * sequences.size(), 0.0f) {
+  std::vector<std::vector<uint64_t>> encoded(sequence_count);
+  thread_pool.parallel_for(0, sequence_count, [&](unsigned int i) {
+    encoded[i] = encode_sequence(sequences[i].second);
+  });
+
+  const unsigned int word_count = encoded[0].size();
+
+  // Saturated distances are clamped to stay finite.
+  const double max_proportion = 0.75 - 1.0 / (4.0 * site_count);
+
+  auto compute_row = [&](unsigned int i) {
+    for (unsigned int j = i + 1; j < sequence_count; j++) {
+      double proportion =
+          (double)count_mismatches(encoded[i].data(), encoded[j].data(),
+                                   word_count) /
+          site_count;
+      proportion = std::min(proportion, max_proportion);
+
+      float distance = -0.75 * log(1.0 - 4.0 / 3.0 * proportion);
+      distances[i * sequence_count + j] = distance;
+      distances[j * sequence_count + i] = distance;
+    }
+  };
+
+  // Row i computes the upper triangle only, so a long row is paired with a
+  // short one to give every thread the same amount of work.
+  thread_pool.parallel_for(0, (sequence_count + 1) / 2, [&](unsigned int i) {
+    compute_row(i);
+    if (sequence_count - 1 - i != i)
+      compute_row(sequence_count - 1 - i);
+  });
+}
@@ -18,7 +18,12 @@ parse_sequences(std::string file_path) {
     std::string s(sequence);
 
     sequences.push_back({h, s});
+
+    free(header);
+    free(sequence);
   }
 
+  pll_fasta_close(fasta);
+
   return sequences;
 }
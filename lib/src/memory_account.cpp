@@ -0,0 +1,109 @@
+#include "memory_account.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "pll_buffer_manager.h"
+
+/**
+   Names of the memory categories used in reports.
+ */
+const char *memory_category_names[memory_category_count] = {
+    "clv", "scaler", "pmatrix", "node", "edge", "particle"};
+
+MemoryAccount::MemoryAccount() : peak_total(0), degraded(false), budget(0),
+                                 degrade_on_budget(false) {
+  for (unsigned int c = 0; c < memory_category_count; c++) {
+    live[c] = 0;
+    pooled[c] = 0;
+    peak[c] = 0;
+  }
+}
+
+void MemoryAccount::update_peaks(MemoryCategory category) {
+  const unsigned int c = (unsigned int)category;
+
+  size_t usage = live[c] + pooled[c];
+  size_t previous = peak[c];
+  while (usage > previous && !peak[c].compare_exchange_weak(previous, usage))
+    ;
+
+  usage = total();
+  previous = peak_total;
+  while (usage > previous && !peak_total.compare_exchange_weak(previous, usage))
+    ;
+}
+
+void MemoryAccount::allocate(MemoryCategory category, size_t bytes) {
+  live[(unsigned int)category] += bytes;
+  update_peaks(category);
+}
+
+void MemoryAccount::release(MemoryCategory category, size_t bytes) {
+  live[(unsigned int)category] -= bytes;
+}
+
+void MemoryAccount::pool(MemoryCategory category, size_t bytes) {
+  pooled[(unsigned int)category] += bytes;
+  live[(unsigned int)category] -= bytes;
+}
+
+void MemoryAccount::reuse(MemoryCategory category, size_t bytes) {
+  live[(unsigned int)category] += bytes;
+  pooled[(unsigned int)category] -= bytes;
+}
+
+void MemoryAccount::release_pooled(MemoryCategory category, size_t bytes) {
+  pooled[(unsigned int)category] -= bytes;
+}
+
+size_t MemoryAccount::total() const {
+  size_t sum = 0;
+  for (unsigned int c = 0; c < memory_category_count; c++)
+    sum += live[c] + pooled[c];
+
+  return sum;
+}
+
+void MemoryAccount::add_manager(PLLBufferManager *manager) {
+  std::lock_guard<std::mutex> lock(managers_mutex);
+  managers.push_back(manager);
+}
+
+void MemoryAccount::remove_manager(PLLBufferManager *manager) {
+  std::lock_guard<std::mutex> lock(managers_mutex);
+  managers.erase(std::remove(managers.begin(), managers.end(), manager),
+                 managers.end());
+}
+
+void MemoryAccount::free_pooled_buffers() {
+  std::lock_guard<std::mutex> lock(managers_mutex);
+  for (PLLBufferManager *manager : managers)
+    manager->free_pooled_buffers();
+}
+
+void MemoryAccount::report(std::ostream &stream) const {
+  const double megabyte = 1024.0 * 1024.0;
+
+  // Formatted separately to leave the flags of 'stream' untouched.
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(1)
+       << "Memory peak: " << peak_total / megabyte << " MB (";
+  for (unsigned int c = 0; c < memory_category_count; c++) {
+    line << (c > 0 ? ", " : "") << memory_category_names[c] << " "
+         << peak[c] / megabyte;
+  }
+  line << "), live/pooled:";
+  for (unsigned int c = 0; c < memory_category_count; c++) {
+    line << " " << memory_category_names[c] << " " << live[c] / megabyte
+         << "/" << pooled[c] / megabyte;
+  }
+  stream << line.str() << std::endl;
+}
+
+void MemoryAccount::reset_peaks() {
+  for (unsigned int c = 0; c < memory_category_count; c++)
+    peak[c] = live[c] + pooled[c];
+  peak_total = total();
+}
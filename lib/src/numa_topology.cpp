@@ -0,0 +1,118 @@
+#include "numa_topology.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+   Parses a Linux CPU or node list such as "0-3,8-11".
+ */
+std::vector<unsigned int> parse_cpu_list(const std::string &list) {
+  std::vector<unsigned int> cpus;
+  std::istringstream stream(list);
+
+  for (std::string range; std::getline(stream, range, ',');) {
+    if (range.find_first_of("0123456789") == std::string::npos)
+      continue;
+
+    size_t dash = range.find('-');
+    unsigned int first = std::stoul(range.substr(0, dash));
+    unsigned int last =
+        dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+
+    for (unsigned int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+
+  return cpus;
+}
+
+std::vector<unsigned int> available_cpus() {
+  std::vector<unsigned int> cpus;
+
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+    }
+  }
+#endif
+
+  if (cpus.empty()) {
+    for (unsigned int cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+      cpus.push_back(cpu);
+  }
+
+  if (cpus.empty())
+    cpus.push_back(0);
+
+  return cpus;
+}
+
+NumaTopology detect_numa_topology() {
+  const std::string path = "/sys/devices/system/node/";
+  NumaTopology topology;
+
+  std::ifstream online_file(path + "online");
+  std::string online;
+  if (std::getline(online_file, online)) {
+    for (unsigned int node : parse_cpu_list(online)) {
+      std::ifstream cpu_file(path + "node" + std::to_string(node) + "/cpulist");
+      std::string cpu_list;
+      std::getline(cpu_file, cpu_list);
+
+      std::vector<unsigned int> cpus = parse_cpu_list(cpu_list);
+      if (!cpus.empty())
+        topology.node_cpus.push_back(cpus);
+    }
+  }
+
+  if (topology.node_cpus.empty())
+    topology.node_cpus.push_back(available_cpus());
+
+  return topology;
+}
+
+NumaTopology fake_numa_topology(const unsigned int node_count) {
+  std::vector<unsigned int> cpus = available_cpus();
+  NumaTopology topology;
+  topology.node_cpus.resize(node_count);
+
+  if (cpus.size() < node_count) {
+    for (unsigned int node = 0; node < node_count; node++)
+      topology.node_cpus[node].push_back(cpus[node % cpus.size()]);
+  } else {
+    for (unsigned int i = 0; i < cpus.size(); i++)
+      topology.node_cpus[i * node_count / cpus.size()].push_back(cpus[i]);
+  }
+
+  return topology;
+}
+
+void set_thread_cpus(const std::vector<unsigned int> &cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (unsigned int cpu : cpus)
+    CPU_SET(cpu, &set);
+
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    std::cerr << "Couldn't set the CPUs of a thread" << std::endl;
+#endif
+}
+
+void pin_thread(const NumaTopology &topology, const unsigned int node) {
+  if (topology.node_cpus.empty())
+    return;
+
+  set_thread_cpus(topology.node_cpus[node]);
+}
@@ -4,11 +4,13 @@ Particle::Particle(
     double weight,
     const std::vector<std::pair<std::string, std::string>> sequences,
     const unsigned int sequence_lengths,
-    const pll_partition_t *reference_partition,
-    PLLBufferManager *const pll_buffer_manager)
+    const ReferencePartitions *reference_partitions,
+    PLLBufferManager *const pll_buffer_manager,
+    const DistanceMatrix *distance_matrix)
     : weight(weight), normalized_weight(exp(weight)) {
-  forest = new PhyloForest(sequences, sequence_lengths, reference_partition,
-                           pll_buffer_manager);
+  forest = new PhyloForest(sequences, sequence_lengths, reference_partitions,
+                           pll_buffer_manager, distance_matrix);
+  get_memory_account()->allocate(MemoryCategory::PARTICLE, particle_size);
 
   std::random_device random;
   mt_generator = std::mt19937(random());
@@ -17,6 +19,7 @@ Particle::Particle(
 Particle::Particle(const Particle &original)
     : weight(original.weight), normalized_weight(original.normalized_weight) {
   forest = new PhyloForest(*original.forest);
+  get_memory_account()->allocate(MemoryCategory::PARTICLE, particle_size);
 
   std::random_device random;
   mt_generator = std::mt19937(random());
@@ -33,20 +36,58 @@ Particle &Particle::operator=(const Particle &original) {
   return *this;
 }
 
-Particle::~Particle() { delete (forest); }
+Particle::~Particle() {
+  get_memory_account()->release(MemoryCategory::PARTICLE, particle_size);
+  delete (forest);
+}
 
 void Particle::propose() {
+  Particle *particle = this;
+  propose_all(&particle, 1);
+}
+
+void Particle::propose_all(Particle *const *particles,
+                           const unsigned int count) {
+  std::vector<PhyloTreeEdge *> edges;
+  edges.reserve(2 * count);
+
+  for (unsigned int i = 0; i < count; i++) {
+    Particle *particle = particles[i];
+    assert(particle->forest->get_reference_partitions() ==
+               particles[0]->forest->get_reference_partitions() &&
+           "Expected the same reference partitions for all particles");
+    particle->prepare_proposal();
+
+    const PendingMerge &merge = particle->pending_merge;
+    edges.push_back(merge.edge_l.get());
+    edges.push_back(merge.edge_r.get());
+  }
+
+  if (count > 0)
+    particles[0]->forest->build_pmatrices(edges);
+
+  for (unsigned int i = 0; i < count; i++)
+    particles[i]->finish_proposal();
+}
+
+void Particle::prepare_proposal() {
   assert(forest->root_count() > 1 &&
          "Cannot propose a continuation on a single root node");
 
-  std::uniform_int_distribution<int> int_dist(0, forest->root_count() - 1);
-  int i = int_dist(mt_generator);
+  int i = -1;
   int j = -1;
-
-  while (j == -1) {
-    j = int_dist(mt_generator);
-    if (j == i)
-      j = -1;
+  double ln_pair_ratio = 0.0;
+
+  if (forest->has_root_distances()) {
+    ln_pair_ratio = propose_close_pair(i, j);
+  } else {
+    std::uniform_int_distribution<int> int_dist(0, forest->root_count() - 1);
+    i = int_dist(mt_generator);
+    while (j == -1) {
+      j = int_dist(mt_generator);
+      if (j == i)
+        j = -1;
+    }
   }
 
   double root_count = forest->root_count();
@@ -55,9 +96,73 @@ void Particle::propose() {
   std::exponential_distribution<double> exponential_dist(rate);
   double height = exponential_dist(mt_generator);
 
-  std::shared_ptr<PhyloTreeNode> node = forest->connect(i, j, height);
+  pending_merge = forest->prepare_connect(i, j, height);
+  pending_ln_pair_ratio = ln_pair_ratio;
+}
 
-  weight = forest->likelihood_factor(node);
+void Particle::finish_proposal() {
+  std::shared_ptr<PhyloTreeNode> node = forest->connect(pending_merge);
+  pending_merge = PendingMerge();
+
+  weight = forest->likelihood_factor(node) + pending_ln_pair_ratio;
 
   assert(!isnan(weight) && !isinf(weight));
 }
+
+double Particle::propose_close_pair(int &i, int &j) {
+  const unsigned int root_count = forest->root_count();
+
+  // Closeness of every root to root k, with one mismatching site as the
+  // smallest distance that is told apart from zero.
+  const double epsilon =
+      1.0 / forest->get_distance_matrix()->get_site_count();
+  // The roots of the sequences are shared by both roots of the pair.
+  const std::vector<unsigned int> sequence_roots = forest->sequence_roots();
+  std::vector<double> closeness(root_count);
+  auto compute_closeness = [&](unsigned int k) {
+    std::vector<double> distances = forest->root_distances(k, sequence_roots);
+
+    double sum = 0.0;
+    for (unsigned int l = 0; l < root_count; l++) {
+      closeness[l] = l == k ? 0.0 : 1.0 / (distances[l] + epsilon);
+      sum += closeness[l];
+    }
+    return sum;
+  };
+
+  // The first root is uniform, the second is chosen by closeness to it.
+  std::uniform_int_distribution<int> int_dist(0, root_count - 1);
+  i = int_dist(mt_generator);
+
+  double i_sum = compute_closeness(i);
+  std::discrete_distribution<int> closeness_dist(closeness.begin(),
+                                                 closeness.end());
+  j = closeness_dist(mt_generator);
+  double i_closeness = closeness[j] / i_sum;
+
+  double j_sum = compute_closeness(j);
+  double j_closeness = closeness[i] / j_sum;
+
+  // Either root of the pair could have been chosen first.
+  double ln_proposal = log((i_closeness + j_closeness) / root_count);
+  double ln_prior = -log(root_count * (root_count - 1.0) / 2.0);
+
+  return ln_prior - ln_proposal;
+}
+
+unsigned int Particle::rejuvenate(const unsigned int move_count,
+                                  unsigned int &proposed_count) {
+  std::bernoulli_distribution height_move_dist(0.5);
+  unsigned int accepted = 0;
+
+  for (unsigned int i = 0; i < move_count; i++) {
+    MoveResult result = height_move_dist(mt_generator)
+                            ? forest->rejuvenate_height(mt_generator)
+                            : forest->rejuvenate_exchange(mt_generator);
+
+    proposed_count += result != MoveResult::NOT_PROPOSED;
+    accepted += result == MoveResult::ACCEPTED;
+  }
+
+  return accepted;
+}
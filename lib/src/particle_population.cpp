@@ -0,0 +1,150 @@
+#include "particle_population.h"
+
+ParticlePopulation::ParticlePopulation(
+    const unsigned int count,
+    const std::vector<std::pair<std::string, std::string>> sequences,
+    const ReferencePartitions *reference_partitions,
+    const std::vector<PLLBufferManager *> &pll_buffer_managers,
+    const DistanceMatrix *distance_matrix,
+    const std::vector<unsigned int> &shard_weights, ThreadPool *thread_pool)
+    : shard_weights(shard_weights), thread_pool(thread_pool) {
+  assert(sequences.size() > 0 && "Expected at least one sequence");
+  const unsigned int sequence_lengths = sequences[0].second.length();
+  for (auto &s : sequences) {
+    assert(s.second.length() == sequence_lengths &&
+           "Sequence lengths do not match");
+  }
+  assert(pll_buffer_managers.size() > 0 && "Expected a buffer manager");
+
+  if (this->shard_weights.empty())
+    this->shard_weights.resize(pll_buffer_managers.size(), 1);
+  assert(this->shard_weights.size() == pll_buffer_managers.size() &&
+         "Expected a weight for every shard");
+
+  const double initial_weight = log(1.0 / (double)count);
+
+  prototypes.resize(pll_buffer_managers.size(), nullptr);
+  spares.resize(prototypes.size());
+
+  std::vector<unsigned int> sizes = shard_sizes(count);
+  std::vector<std::vector<Particle *>> shards(prototypes.size());
+  try {
+    for_each_shard([&](unsigned int shard) {
+      prototypes[shard] = new Particle(initial_weight, sequences,
+                                       sequence_lengths, reference_partitions,
+                                       pll_buffer_managers[shard],
+                                       distance_matrix);
+      for (unsigned int i = 0; i < sizes[shard]; i++)
+        shards[shard].push_back(new Particle(*prototypes[shard]));
+    });
+  } catch (...) {
+    // No destructor runs for a throwing constructor.
+    for (auto &shard : shards) {
+      for (auto &p : shard)
+        delete p;
+    }
+    for (auto &p : prototypes)
+      delete p;
+    throw;
+  }
+
+  generation_shards.push_back(0);
+  for (auto &shard : shards) {
+    generation.insert(generation.end(), shard.begin(), shard.end());
+    generation_shards.push_back(generation.size());
+  }
+
+  next_generation_shards.resize(prototypes.size() + 1, 0);
+}
+
+ParticlePopulation::~ParticlePopulation() {
+  for (auto &p : generation)
+    delete p;
+  for (auto &p : next_generation)
+    delete p;
+  for (auto &shard_spares : spares) {
+    for (auto &p : shard_spares) {
+      p->get_memory_account()->reuse(MemoryCategory::PARTICLE, particle_size);
+      delete p;
+    }
+  }
+  for (auto &p : prototypes)
+    delete p;
+}
+
+std::vector<unsigned int>
+ParticlePopulation::shard_sizes(const unsigned int count) const {
+  unsigned int weight_sum = 0;
+  for (unsigned int weight : shard_weights)
+    weight_sum += weight;
+
+  std::vector<unsigned int> sizes;
+  unsigned int assigned = 0;
+  unsigned int cumulative_weight = 0;
+  for (unsigned int weight : shard_weights) {
+    cumulative_weight += weight;
+    unsigned int end =
+        (unsigned long)count * cumulative_weight / weight_sum;
+    sizes.push_back(end - assigned);
+    assigned = end;
+  }
+
+  return sizes;
+}
+
+void ParticlePopulation::resize_next_generation(const unsigned int count) {
+  std::vector<unsigned int> sizes = shard_sizes(count);
+  std::vector<std::vector<Particle *>> shards;
+  for (unsigned int shard = 0; shard < prototypes.size(); shard++) {
+    shards.emplace_back(
+        next_generation.begin() + next_generation_shards[shard],
+        next_generation.begin() + next_generation_shards[shard + 1]);
+  }
+
+  // Particles of all shards are kept if one throws, so that the destructor
+  // deletes them.
+  std::exception_ptr error;
+  try {
+    for_each_shard([&](unsigned int shard) {
+      std::vector<Particle *> &particles = shards[shard];
+
+      while (particles.size() > sizes[shard]) {
+        Particle *particle = particles.back();
+        particles.pop_back();
+
+        *particle = *prototypes[shard];
+        particle->get_memory_account()->pool(MemoryCategory::PARTICLE,
+                                             particle_size);
+        spares[shard].push_back(particle);
+      }
+
+      while (particles.size() < sizes[shard]) {
+        if (spares[shard].empty()) {
+          particles.push_back(new Particle(*prototypes[shard]));
+        } else {
+          Particle *particle = spares[shard].back();
+          spares[shard].pop_back();
+
+          particle->get_memory_account()->reuse(MemoryCategory::PARTICLE,
+                                                particle_size);
+          particles.push_back(particle);
+        }
+      }
+    });
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  std::vector<Particle *> resized;
+  std::vector<unsigned int> resized_shards = {0};
+  for (auto &shard : shards) {
+    resized.insert(resized.end(), shard.begin(), shard.end());
+    resized_shards.push_back(resized.size());
+  }
+
+  next_generation.swap(resized);
+  next_generation_shards.swap(resized_shards);
+
+  if (error)
+    std::rethrow_exception(error);
+}
@@ -0,0 +1,177 @@
+#include "partition_helper.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+/**
+   Returns 'text' without leading and trailing whitespace.
+ */
+std::string trim(const std::string &text) {
+  size_t begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string::npos)
+    return "";
+
+  size_t end = text.find_last_not_of(" \t\r");
+  return text.substr(begin, end - begin + 1);
+}
+
+/**
+   Splits 'text' at every 'separator'.
+ */
+std::vector<std::string> split(const std::string &text, char separator) {
+  std::vector<std::string> parts;
+  std::istringstream stream(text);
+  for (std::string part; std::getline(stream, part, separator);)
+    parts.push_back(part);
+
+  return parts;
+}
+
+/**
+   Parses 'count' numbers separated by '/' from the braces of a model term
+   such as 'GTR{1/2/1/1/2/1}'. Returns false if the term has no braces.
+ */
+bool parse_parameters(const std::string &term, double *parameters,
+                      unsigned int count) {
+  size_t open = term.find('{');
+  if (open == std::string::npos)
+    return false;
+
+  size_t close = term.find('}', open);
+  if (close != term.size() - 1)
+    throw std::runtime_error("Expected '}' at the end of '" + term + "'");
+
+  std::vector<std::string> values =
+      split(term.substr(open + 1, close - open - 1), '/');
+  if (values.size() != count)
+    throw std::runtime_error("Expected " + std::to_string(count) +
+                             " parameters in '" + term + "'");
+
+  for (unsigned int i = 0; i < count; i++)
+    parameters[i] = std::stod(values[i]);
+
+  return true;
+}
+
+/**
+   Sets the model parameters of 'partition' from a model string.
+ */
+void parse_model(const std::string &model, AlignmentPartition &partition) {
+  std::vector<std::string> terms = split(model, '+');
+  std::string base = trim(terms[0]).substr(0, trim(terms[0]).find('{'));
+
+  if (base == "GTR") {
+    parse_parameters(trim(terms[0]), partition.subst_params, 6);
+  } else if (base != "JC" && base != "DNA") {
+    throw std::runtime_error("Unsupported model '" + base + "'");
+  }
+
+  for (unsigned int i = 1; i < terms.size(); i++) {
+    std::string term = trim(terms[i]);
+    std::string name = term.substr(0, term.find('{'));
+
+    if (name == "G" || name == "G4") {
+      partition.gamma_rates = true;
+      parse_parameters(term, &partition.gamma_alpha, 1);
+    } else if (name == "F" || name == "FC") {
+      partition.empirical_frequencies = true;
+    } else if (name == "FE") {
+      partition.empirical_frequencies = false;
+    } else if (name == "FU") {
+      if (!parse_parameters(term, partition.frequencies, 4))
+        throw std::runtime_error("Expected frequencies in '" + term + "'");
+    } else {
+      throw std::runtime_error("Unsupported model term '" + term + "'");
+    }
+  }
+}
+
+/**
+   Adds the zero-based columns of a one-based range to 'partition'.
+ */
+void parse_range(const std::string &range, unsigned int column_count,
+                 AlignmentPartition &partition) {
+  unsigned int first, last, stride = 1;
+
+  std::vector<std::string> bounds = split(range.substr(0, range.find('\\')), '-');
+  if (bounds.size() < 1 || bounds.size() > 2)
+    throw std::runtime_error("Invalid range '" + range + "'");
+
+  first = std::stoul(bounds[0]);
+  last = bounds.size() == 2 ? std::stoul(bounds[1]) : first;
+  if (range.find('\\') != std::string::npos)
+    stride = std::stoul(range.substr(range.find('\\') + 1));
+
+  if (first < 1 || last > column_count || first > last || stride < 1)
+    throw std::runtime_error("Range '" + range + "' is out of bounds");
+
+  for (unsigned int c = first; c <= last; c += stride)
+    partition.columns.push_back(c - 1);
+}
+
+std::vector<AlignmentPartition> parse_partitions(std::string file_path,
+                                                 unsigned int column_count) {
+  std::ifstream file(file_path);
+  if (!file)
+    throw std::runtime_error("Can't open partition file " + file_path);
+
+  std::vector<AlignmentPartition> partitions;
+  std::vector<bool> covered(column_count, false);
+
+  unsigned int line_number = 0;
+  for (std::string line; std::getline(file, line);) {
+    line_number++;
+    line = trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    AlignmentPartition partition;
+    try {
+      size_t equals = line.find('=');
+      size_t comma = line.find(',');
+      if (equals == std::string::npos || comma == std::string::npos ||
+          comma > equals)
+        throw std::runtime_error("Expected 'MODEL, NAME = RANGES'");
+
+      parse_model(line.substr(0, comma), partition);
+      partition.name = trim(line.substr(comma + 1, equals - comma - 1));
+
+      for (auto &range : split(line.substr(equals + 1), ','))
+        parse_range(trim(range), column_count, partition);
+    } catch (const std::logic_error &) {
+      // Thrown by std::stod and std::stoul.
+      throw std::runtime_error(file_path + ":" +
+                               std::to_string(line_number) +
+                               ": Invalid number");
+    } catch (const std::runtime_error &error) {
+      throw std::runtime_error(file_path + ":" +
+                               std::to_string(line_number) + ": " +
+                               error.what());
+    }
+
+    for (unsigned int c : partition.columns) {
+      if (covered[c])
+        throw std::runtime_error(file_path + ":" +
+                                 std::to_string(line_number) + ": Column " +
+                                 std::to_string(c + 1) +
+                                 " is already in a partition");
+      covered[c] = true;
+    }
+
+    partitions.push_back(partition);
+  }
+
+  if (partitions.empty())
+    throw std::runtime_error("No partitions in " + file_path);
+
+  unsigned int uncovered = 0;
+  for (bool c : covered)
+    uncovered += !c;
+  if (uncovered > 0)
+    std::cerr << uncovered << " alignment columns aren't in any partition "
+              << "and are ignored" << std::endl;
+
+  return partitions;
+}
@@ -1,18 +1,26 @@
 #include "phylo_forest.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
 PhyloForest::PhyloForest(
     const std::vector<std::pair<std::string, std::string>> sequences,
     const unsigned int sequence_lengths,
-    const pll_partition_t *reference_partition,
-    PLLBufferManager *const pll_buffer_manager)
-    : reference_partition(reference_partition),
-      pll_buffer_manager(pll_buffer_manager), forest_height(0.0) {
+    const ReferencePartitions *reference_partitions,
+    PLLBufferManager *const pll_buffer_manager,
+    const DistanceMatrix *distance_matrix)
+    : reference_partitions(reference_partitions),
+      pll_buffer_manager(pll_buffer_manager), distance_matrix(distance_matrix),
+      forest_height(0.0) {
   setup_sequences_pll(sequences, sequence_lengths);
 }
 
 PhyloForest::PhyloForest(const PhyloForest &original)
     : pll_buffer_manager(original.pll_buffer_manager) {
-  reference_partition = original.reference_partition;
+  reference_partitions = original.reference_partitions;
+  distance_matrix = original.distance_matrix;
   forest_height = original.forest_height;
   roots = original.roots;
 }
@@ -21,7 +29,8 @@ PhyloForest &PhyloForest::operator=(const PhyloForest &original) {
   if (this == &original)
     return *this;
 
-  reference_partition = original.reference_partition;
+  reference_partitions = original.reference_partitions;
+  distance_matrix = original.distance_matrix;
   forest_height = original.forest_height;
   roots = original.roots;
 
@@ -30,45 +39,112 @@ PhyloForest &PhyloForest::operator=(const PhyloForest &original) {
 
 PhyloForest::~PhyloForest() {}
 
-double compute_ln_likelihood(double *clv, unsigned int *scale_buffer,
-                             const pll_partition_t *p) {
+/**
+   Log-likelihood of the sites of 'chunk' given a 'clv' and 'scale_buffer'
+   pointing to the chunk's first site.
+ */
+double compute_ln_likelihood(const double *clv,
+                             const unsigned int *scale_buffer,
+                             const pll_partition_t *p,
+                             const ReferencePartitions::Chunk &chunk) {
   const unsigned int parameter_indices[4] = {0, 0, 0, 0};
 
   return pll_core_root_loglikelihood(
-      p->states, p->sites, p->rate_cats,
+      p->states, chunk.end - chunk.begin, p->rate_cats,
 
       clv, scale_buffer,
 
-      p->frequencies, p->rate_weights, p->pattern_weights, p->prop_invar,
-      p->invariant, parameter_indices, NULL, p->attributes);
+      p->frequencies, p->rate_weights, p->pattern_weights + chunk.begin,
+      p->prop_invar, p->invariant ? p->invariant + chunk.begin : NULL,
+      parameter_indices, NULL, p->attributes);
+}
+
+/**
+   Number of sites whose single precision clvs are converted at a time. The
+   double precision copies of a slice of both children and the parent stay
+   in cache until the slice has been computed.
+ */
+const unsigned int conversion_slice_sites = 128;
+
+/**
+   Returns 2^exponent for exponents of normal doubles, built directly in the
+   exponent bits.
+ */
+inline double power_of_two(const int exponent) {
+  assert(exponent >= -1022 && exponent <= 1023 && "Exponent out of range");
+
+  const uint64_t bits = (uint64_t)(exponent + 1023) << 52;
+  double power;
+  std::memcpy(&power, &bits, sizeof(double));
+  return power;
+}
+
+/**
+   Expands a single precision clv into a double precision 'clv' and a 'scaler'
+   following the PLL scaling convention. The single precision scale buffer
+   counts powers of two, every whole PLL_SCALE_EXPONENT is moved to the PLL
+   scaler and the remainder is applied to the clv entries.
+ */
+void expand_clv(const float *clv_single, const unsigned int *scale_buffer,
+                double *clv, unsigned int *scaler,
+                const unsigned int clv_length,
+                const unsigned int scaler_size) {
+  const unsigned int block_size = clv_length / scaler_size;
+
+  for (unsigned int b = 0; b < scaler_size; b++) {
+    scaler[b] = scale_buffer[b] / PLL_SCALE_EXPONENT;
+    const double factor =
+        power_of_two(-(int)(scale_buffer[b] % PLL_SCALE_EXPONENT));
+
+    for (unsigned int k = b * block_size; k < (b + 1) * block_size; k++)
+      clv[k] = clv_single[k] * factor;
+  }
+}
+
+/**
+   Stores a double precision clv and PLL 'scaler' as a single precision clv.
+   Each scaling block is shifted by a power of two so that its largest entry
+   lies in [0.5, 1), keeping the block far away from float underflow. The shift
+   is added to the scale buffer.
+ */
+void compress_clv(const double *clv, const unsigned int *scaler,
+                  float *clv_single, unsigned int *scale_buffer,
+                  const unsigned int clv_length,
+                  const unsigned int scaler_size) {
+  const unsigned int block_size = clv_length / scaler_size;
+
+  for (unsigned int b = 0; b < scaler_size; b++) {
+    double max = 0.0;
+    for (unsigned int k = b * block_size; k < (b + 1) * block_size; k++)
+      max = std::max(max, clv[k]);
+
+    int exponent = 0;
+    if (max > 0.0)
+      std::frexp(max, &exponent);
+    const int shift = exponent < 0 ? -exponent : 0;
+    const double factor = power_of_two(shift);
+
+    scale_buffer[b] = scaler[b] * PLL_SCALE_EXPONENT + shift;
+    for (unsigned int k = b * block_size; k < (b + 1) * block_size; k++)
+      clv_single[k] = (float)(clv[k] * factor);
+  }
 }
 
 void PhyloForest::setup_sequences_pll(
     std::vector<std::pair<std::string, std::string>> sequences,
     const unsigned int sequence_lengths) {
-
-  const pll_partition_t *p = reference_partition;
+  const ReferencePartitions &partitions = *reference_partitions;
 
   for (unsigned int i = 0; i < sequences.size(); i++) {
-    std::string label = sequences[i].first;
-
-    unsigned int sites_alloc =
-        p->asc_bias_alloc ? p->sites + p->states : p->sites;
-
-    unsigned int clv_size =
-        sites_alloc * p->states_padded * p->rate_cats * sizeof(double);
-    unsigned int scaler_size = (p->attributes & PLL_ATTRIB_RATE_SCALERS)
-                                   ? sites_alloc * p->rate_cats
-                                   : sites_alloc;
-
     std::shared_ptr<PhyloTreeNode> node = std::make_shared<PhyloTreeNode>(
-        pll_buffer_manager, nullptr, nullptr, label, forest_height, clv_size,
-        scaler_size);
-    delete (node->clv);
-    delete (node->scale_buffer);
-    node->clv = p->clv[i];
-    node->scale_buffer = nullptr;
-    node->ln_likelihood = compute_ln_likelihood(node->clv, nullptr, p);
+        pll_buffer_manager, sequences[i].first, i);
+
+    node->ln_likelihood = 0.0;
+    for (unsigned int k = 0; k < partitions.partition_count(); k++) {
+      const pll_partition_t *p = partitions.get_partition(k);
+      node->ln_likelihood += compute_ln_likelihood(
+          partitions.tip_clv(i, k), nullptr, p, {k, 0, p->sites});
+    }
 
     roots.push_back(node);
   }
@@ -76,80 +152,342 @@ void PhyloForest::setup_sequences_pll(
 
 std::shared_ptr<PhyloTreeNode> PhyloForest::connect(int i, int j,
                                                     double height_delta) {
+  PendingMerge merge = prepare_connect(i, j, height_delta);
+
+  build_pmatrices({merge.edge_l.get(), merge.edge_r.get()});
+
+  return connect(merge);
+}
+
+PendingMerge PhyloForest::prepare_connect(int i, int j,
+                                          double height_delta) const {
   assert(roots.size() > 1 && "Expected more than one root");
   assert(i != j && "Cannot connect, this would make a loop");
   assert(height_delta >= 0 && "Height change can't be negative");
   assert(i >= 0 && i < roots.size() && j >= 0 && j < roots.size() &&
          "Index out of bounds");
 
-  const pll_partition_t *p = reference_partition;
+  double height = forest_height + height_delta;
+  assert(height < 100);
 
-  forest_height += height_delta;
-  assert(forest_height < 100);
+  return {i, j, height, create_edge(roots[i], height),
+          create_edge(roots[j], height)};
+}
 
-  std::shared_ptr<PhyloTreeNode> child_left = roots[i];
-  std::shared_ptr<PhyloTreeNode> child_right = roots[j];
+std::shared_ptr<PhyloTreeNode> PhyloForest::connect(const PendingMerge &merge) {
+  const int i = merge.i;
+  const int j = merge.j;
+  assert(merge.edge_l->child == roots[i] && merge.edge_r->child == roots[j] &&
+         "Merge was prepared for other roots");
 
-  double left_length = forest_height - child_left->height;
-  double right_length = forest_height - child_right->height;
+  forest_height = merge.height;
 
-  unsigned int pmatrix_size =
-      p->states * p->states_padded * p->rate_cats * sizeof(double);
+  std::shared_ptr<PhyloTreeNode> parent =
+      create_node(merge.edge_l, merge.edge_r, forest_height);
 
-  std::shared_ptr<PhyloTreeEdge> edge_left = std::make_shared<PhyloTreeEdge>(
-      pll_buffer_manager, child_left, left_length, pmatrix_size);
+  // Remove children
+  remove_roots(i, j);
+  // Add new internal node
+  roots.push_back(parent);
 
-  std::shared_ptr<PhyloTreeEdge> edge_right = std::make_shared<PhyloTreeEdge>(
-      pll_buffer_manager, child_right, right_length, pmatrix_size);
+  return parent;
+}
 
-  unsigned int sites_alloc =
-      p->asc_bias_alloc ? p->sites + p->states : p->sites;
+void PhyloForest::build_pmatrices(
+    const std::vector<PhyloTreeEdge *> &edges) const {
+  std::vector<double> lengths(edges.size());
+  std::vector<double *> pmatrices(edges.size());
+  for (unsigned int e = 0; e < edges.size(); e++) {
+    lengths[e] = edges[e]->length;
+    pmatrices[e] = edges[e]->pmatrix;
+  }
 
-  unsigned int clv_size =
-      sites_alloc * p->states_padded * p->rate_cats * sizeof(double);
-  unsigned int scaler_size = (p->attributes & PLL_ATTRIB_RATE_SCALERS)
-                                 ? sites_alloc * p->rate_cats
-                                 : sites_alloc;
-  unsigned int scale_buffer_size = scaler_size * sizeof(double);
+  reference_partitions->get_pmatrix_builder().build(
+      lengths.data(), pmatrices.data(), edges.size());
+}
 
-  std::shared_ptr<PhyloTreeNode> parent = std::make_shared<PhyloTreeNode>(
-      pll_buffer_manager, edge_left, edge_right, "", forest_height, clv_size,
-      scale_buffer_size);
+std::shared_ptr<PhyloTreeEdge>
+PhyloForest::create_edge(std::shared_ptr<PhyloTreeNode> child,
+                         double height) const {
+  assert(height >= child->height && "Parent can't be below its children");
 
-  const unsigned int matrix_indices[1] = {0};
-  const unsigned int param_indices[4] = {0, 0, 0, 0};
+  return std::make_shared<PhyloTreeEdge>(
+      pll_buffer_manager, child, height - child->height,
+      reference_partitions->pmatrix_length() * sizeof(double));
+}
 
-  int left_edge_pmatrix_result = pll_core_update_pmatrix(
-      &parent->edge_l->pmatrix, p->states, p->rate_cats, p->rates,
-      &parent->edge_l->length, matrix_indices, param_indices, p->prop_invar,
-      p->eigenvals, p->eigenvecs, p->inv_eigenvecs, 1, p->attributes);
-  assert(left_edge_pmatrix_result == PLL_SUCCESS);
+std::shared_ptr<PhyloTreeNode>
+PhyloForest::create_node(std::shared_ptr<PhyloTreeNode> child_left,
+                         std::shared_ptr<PhyloTreeNode> child_right,
+                         double height) {
+  std::shared_ptr<PhyloTreeEdge> edge_left = create_edge(child_left, height);
+  std::shared_ptr<PhyloTreeEdge> edge_right = create_edge(child_right, height);
 
-  int right_edge_pmatrix_result = pll_core_update_pmatrix(
-      &parent->edge_r->pmatrix, p->states, p->rate_cats, p->rates,
-      &parent->edge_r->length, matrix_indices, param_indices, p->prop_invar,
-      p->eigenvals, p->eigenvecs, p->inv_eigenvecs, 1, p->attributes);
-  assert(right_edge_pmatrix_result == PLL_SUCCESS);
+  build_pmatrices({edge_left.get(), edge_right.get()});
 
-  pll_core_update_partial_ii(
-      p->states, (p->asc_bias_alloc ? p->sites + p->states : p->sites),
-      p->rate_cats, parent->clv, parent->scale_buffer, child_left->clv,
-      child_right->clv, edge_left->pmatrix, edge_right->pmatrix,
-      child_left->scale_buffer, child_right->scale_buffer, p->attributes);
+  return create_node(edge_left, edge_right, height);
+}
 
-  parent->ln_likelihood =
-      compute_ln_likelihood(parent->clv, parent->scale_buffer, p);
+std::shared_ptr<PhyloTreeNode>
+PhyloForest::create_node(std::shared_ptr<PhyloTreeEdge> edge_left,
+                         std::shared_ptr<PhyloTreeEdge> edge_right,
+                         double height) {
+  const ReferencePartitions &partitions = *reference_partitions;
+  const PhyloTreeNode *child_left = edge_left->child.get();
+  const PhyloTreeNode *child_right = edge_right->child.get();
 
-  assert(parent->ln_likelihood <= 0 && "Likelihood can't be more than 100%");
+  const unsigned int clv_length = partitions.clv_length();
+  const unsigned int scaler_size = partitions.scaler_length();
 
-  // Remove children
-  remove_roots(i, j);
-  // Add new internal node
-  roots.push_back(parent);
+  std::shared_ptr<PhyloTreeNode> parent = std::make_shared<PhyloTreeNode>(
+      pll_buffer_manager, edge_left, edge_right, "", height,
+      clv_length * sizeof(double), scaler_size * sizeof(unsigned int));
+
+  const unsigned int site_clv_length = partitions.site_clv_length();
+  const unsigned int site_scaler_length = partitions.site_scaler_length();
+
+  // Single precision clvs are computed in double precision a slice of sites
+  // at a time and only converted when read from the children or stored in
+  // the parent. The scratch is owned by the chunk task using it.
+  const bool convert = child_left->clv_single || child_right->clv_single ||
+                       parent->clv_single;
+
+  // Double precision clv and scaler of the sites of 'slice' of a child.
+  // Leaves use the tip clvs of their partition and have no scale buffer.
+  auto slice_clv = [&](const PhyloTreeNode &node,
+                       const ReferencePartitions::Chunk &slice,
+                       std::vector<double> &clv_scratch,
+                       std::vector<unsigned int> &scaler_scratch,
+                       const unsigned int **scaler) -> const double * {
+    if (!node.edge_l) {
+      *scaler = nullptr;
+      return partitions.tip_clv(node.tip_index, slice.partition) +
+             slice.begin * site_clv_length;
+    }
+
+    const unsigned int site =
+        partitions.site_offset(slice.partition) + slice.begin;
+    if (!node.clv_single) {
+      *scaler = node.scale_buffer + site * site_scaler_length;
+      return node.clv + site * site_clv_length;
+    }
+
+    const unsigned int sites = slice.end - slice.begin;
+    clv_scratch.resize(sites * site_clv_length);
+    scaler_scratch.resize(sites * site_scaler_length);
+    expand_clv(node.clv_single + site * site_clv_length,
+               node.scale_buffer + site * site_scaler_length,
+               clv_scratch.data(), scaler_scratch.data(),
+               sites * site_clv_length, sites * site_scaler_length);
+
+    *scaler = scaler_scratch.data();
+    return clv_scratch.data();
+  };
+
+  std::vector<double> task_ln_likelihoods(partitions.task_count(), 0.0);
+  partitions.for_each_chunk([&](unsigned int task,
+                                const ReferencePartitions::Chunk &chunk) {
+    const pll_partition_t *p = partitions.get_partition(chunk.partition);
+    const unsigned int pmatrix_offset =
+        chunk.partition * partitions.partition_pmatrix_length();
+
+    std::vector<double> left_scratch, right_scratch, parent_scratch;
+    std::vector<unsigned int> left_scaler_scratch, right_scaler_scratch,
+        parent_scaler_scratch;
+
+    const unsigned int slice_sites =
+        convert ? conversion_slice_sites : chunk.end - chunk.begin;
+    for (unsigned int begin = chunk.begin; begin < chunk.end;
+         begin += slice_sites) {
+      const ReferencePartitions::Chunk slice = {
+          chunk.partition, begin, std::min(begin + slice_sites, chunk.end)};
+      const unsigned int sites = slice.end - slice.begin;
+      const unsigned int site =
+          partitions.site_offset(slice.partition) + slice.begin;
+
+      const unsigned int *left_scaler;
+      const unsigned int *right_scaler;
+      const double *left_clv = slice_clv(*child_left, slice, left_scratch,
+                                         left_scaler_scratch, &left_scaler);
+      const double *right_clv = slice_clv(*child_right, slice, right_scratch,
+                                          right_scaler_scratch, &right_scaler);
+
+      double *parent_clv = parent->clv + site * site_clv_length;
+      unsigned int *parent_scaler =
+          parent->scale_buffer + site * site_scaler_length;
+      if (parent->clv_single) {
+        parent_scratch.resize(sites * site_clv_length);
+        parent_scaler_scratch.resize(sites * site_scaler_length);
+        parent_clv = parent_scratch.data();
+        parent_scaler = parent_scaler_scratch.data();
+      }
+
+      pll_core_update_partial_ii(
+          p->states, sites, p->rate_cats, parent_clv, parent_scaler, left_clv,
+          right_clv, edge_left->pmatrix + pmatrix_offset,
+          edge_right->pmatrix + pmatrix_offset, left_scaler, right_scaler,
+          p->attributes);
+
+      task_ln_likelihoods[task] +=
+          compute_ln_likelihood(parent_clv, parent_scaler, p, slice);
+
+      if (parent->clv_single)
+        compress_clv(parent_clv, parent_scaler,
+                     parent->clv_single + site * site_clv_length,
+                     parent->scale_buffer + site * site_scaler_length,
+                     sites * site_clv_length, sites * site_scaler_length);
+    }
+  });
+
+  parent->ln_likelihood = 0.0;
+  for (double ln_likelihood : task_ln_likelihoods)
+    parent->ln_likelihood += ln_likelihood;
+
+  assert(parent->ln_likelihood <= 0 && "Likelihood can't be more than 100%");
 
   return parent;
 }
 
+MoveResult PhyloForest::rejuvenate_height(std::mt19937 &mt_generator) {
+  std::shared_ptr<PhyloTreeNode> top = roots.back();
+  if (!top->edge_l || !top->edge_r)
+    return MoveResult::NOT_PROPOSED;
+  assert(top->height == forest_height && "Expected most recent merge last");
+
+  // The merge before the most recent one is either one of its children or
+  // one of the other roots.
+  double previous_height =
+      std::max(top->edge_l->child->height, top->edge_r->child->height);
+  for (unsigned int i = 0; i < roots.size() - 1; i++)
+    previous_height = std::max(previous_height, roots[i]->height);
+
+  double lineages = roots.size() + 1;
+  double rate = lineages * (lineages - 1) / 2;
+
+  // Multiplicative random walk on the waiting time since the previous merge.
+  std::uniform_real_distribution<double> unit_dist(0.0, 1.0);
+  double delta = top->height - previous_height;
+  double proposed_delta = delta * exp(unit_dist(mt_generator) - 0.5);
+
+  std::shared_ptr<PhyloTreeNode> proposed =
+      create_node(top->edge_l->child, top->edge_r->child,
+                  previous_height + proposed_delta);
+
+  double ln_acceptance = proposed->ln_likelihood - top->ln_likelihood -
+                         rate * (proposed_delta - delta) +
+                         log(proposed_delta / delta);
+
+  if (log(unit_dist(mt_generator)) >= ln_acceptance)
+    return MoveResult::REJECTED;
+
+  roots.back() = proposed;
+  forest_height = proposed->height;
+
+  return MoveResult::ACCEPTED;
+}
+
+MoveResult PhyloForest::rejuvenate_exchange(std::mt19937 &mt_generator) {
+  std::uniform_int_distribution<int> root_dist(0, roots.size() - 1);
+  std::uniform_int_distribution<int> side_dist(0, 1);
+
+  int index = root_dist(mt_generator);
+  bool exchange_left = side_dist(mt_generator);
+  bool keep_left = side_dist(mt_generator);
+
+  std::shared_ptr<PhyloTreeNode> root = roots[index];
+  if (!root->edge_l || !root->edge_r)
+    return MoveResult::NOT_PROPOSED;
+
+  std::shared_ptr<PhyloTreeNode> child =
+      exchange_left ? root->edge_l->child : root->edge_r->child;
+  std::shared_ptr<PhyloTreeNode> sibling =
+      exchange_left ? root->edge_r->child : root->edge_l->child;
+  if (!child->edge_l || !child->edge_r)
+    return MoveResult::NOT_PROPOSED;
+
+  // The sibling must already exist when the child merge happens.
+  if (sibling->height >= child->height)
+    return MoveResult::NOT_PROPOSED;
+
+  std::shared_ptr<PhyloTreeNode> kept =
+      keep_left ? child->edge_l->child : child->edge_r->child;
+  std::shared_ptr<PhyloTreeNode> moved =
+      keep_left ? child->edge_r->child : child->edge_l->child;
+
+  // Only the path from the exchanged child to the root is recomputed.
+  std::shared_ptr<PhyloTreeNode> proposed_child =
+      keep_left ? create_node(kept, sibling, child->height)
+                : create_node(sibling, kept, child->height);
+  std::shared_ptr<PhyloTreeNode> proposed =
+      exchange_left ? create_node(proposed_child, moved, root->height)
+                    : create_node(moved, proposed_child, root->height);
+
+  // Heights and merge order are unchanged, so the prior ratio is one and
+  // the proposal is symmetric.
+  double ln_acceptance = proposed->ln_likelihood - root->ln_likelihood;
+
+  std::uniform_real_distribution<double> unit_dist(0.0, 1.0);
+  if (log(unit_dist(mt_generator)) >= ln_acceptance)
+    return MoveResult::REJECTED;
+
+  roots[index] = proposed;
+
+  return MoveResult::ACCEPTED;
+}
+
+/**
+   Appends the sequence indices of the leaves below 'node' to 'leaves'.
+ */
+void collect_leaves(const PhyloTreeNode &node,
+                    std::vector<unsigned int> &leaves) {
+  if (!node.edge_l) {
+    leaves.push_back(node.tip_index);
+    return;
+  }
+
+  collect_leaves(*node.edge_l->child, leaves);
+  collect_leaves(*node.edge_r->child, leaves);
+}
+
+std::vector<unsigned int> PhyloForest::sequence_roots() const {
+  assert(distance_matrix && "Root distances require a distance matrix");
+
+  std::vector<unsigned int> roots_of_sequences(
+      distance_matrix->get_sequence_count());
+  std::vector<unsigned int> leaves;
+  for (unsigned int r = 0; r < roots.size(); r++) {
+    leaves.clear();
+    collect_leaves(*roots[r], leaves);
+    for (unsigned int leaf : leaves)
+      roots_of_sequences[leaf] = r;
+  }
+
+  return roots_of_sequences;
+}
+
+std::vector<double> PhyloForest::root_distances(
+    const unsigned int k,
+    const std::vector<unsigned int> &sequence_roots) const {
+  assert(distance_matrix && "Root distances require a distance matrix");
+  assert(sequence_roots.size() == distance_matrix->get_sequence_count() &&
+         "Expected the root of every sequence");
+
+  std::vector<double> distances(roots.size(), 0.0);
+  for (unsigned int x = 0; x < sequence_roots.size(); x++) {
+    if (sequence_roots[x] != k)
+      continue;
+
+    for (unsigned int t = 0; t < sequence_roots.size(); t++)
+      distances[sequence_roots[t]] += distance_matrix->distance(x, t);
+  }
+
+  for (unsigned int r = 0; r < roots.size(); r++)
+    distances[r] /= (double)roots[k]->leaf_count * roots[r]->leaf_count;
+  distances[k] = 0.0;
+
+  return distances;
+}
+
 double PhyloForest::likelihood_factor(std::shared_ptr<PhyloTreeNode> root) {
   assert(root->edge_l && root->edge_r && "Root cannot be a leaf");
 
@@ -1,22 +1,28 @@
 #include "phylo_tree.h"
 
+#include <atomic>
+
+/**
+   Source of node creation numbers.
+ */
+std::atomic<unsigned long> next_node_id(0);
+
 PhyloTreeEdge::PhyloTreeEdge(PLLBufferManager *manager,
                              std::shared_ptr<PhyloTreeNode> child,
                              double length, unsigned int pmatrix_size)
     : manager(manager), child(child), length(length) {
-  if (manager->pmatrix_buffer.empty()) {
-    pmatrix = (double *)std::malloc(pmatrix_size);
-  } else {
-    pmatrix = manager->pmatrix_buffer.top();
-    manager->pmatrix_buffer.pop();
-
-    std::memset(pmatrix, 0, pmatrix_size);
-  }
+  // Accounted only once the pmatrix was acquired, which may throw.
+  pmatrix = manager->acquire(manager->pmatrix_buffer, MemoryCategory::PMATRIX,
+                             pmatrix_size);
+  manager->memory_account->allocate(MemoryCategory::EDGE,
+                                    sizeof(PhyloTreeEdge));
 }
 
 PhyloTreeEdge::~PhyloTreeEdge() {
-  manager->pmatrix_buffer.push(pmatrix);
+  manager->recycle(manager->pmatrix_buffer, MemoryCategory::PMATRIX, pmatrix);
   pmatrix = nullptr;
+  manager->memory_account->release(MemoryCategory::EDGE,
+                                   sizeof(PhyloTreeEdge));
 }
 
 PhyloTreeNode::PhyloTreeNode(PLLBufferManager *manager,
@@ -26,30 +32,83 @@ PhyloTreeNode::PhyloTreeNode(PLLBufferManager *manager,
                              unsigned int clv_size,
                              unsigned int scale_buffer_size)
     : manager(manager), edge_l(edge_l), edge_r(edge_r), label(label),
-      height(height) {
-  if (manager->clv_buffer.empty()) {
-    clv = (double *)std::malloc(clv_size);
-  } else {
-    clv = manager->clv_buffer.top();
-    manager->clv_buffer.pop();
+      height(height), id(next_node_id++), tip_index(0), clv(nullptr),
+      clv_single(nullptr) {
+  assert(edge_l && edge_r && "Expected an inner node");
+  leaf_count = edge_l->child->leaf_count + edge_r->child->leaf_count;
 
-    std::memset(clv, 0, clv_size);
-  }
+  // A throwing constructor runs no destructor, so the node is only
+  // accounted once all buffers have been acquired.
+  if (manager->clv_precision == CLVPrecision::SINGLE) {
+    unsigned int clv_single_size = clv_size / sizeof(double) * sizeof(float);
 
-  if (manager->scale_buffer_buffer.empty()) {
-    scale_buffer = (unsigned int *)std::malloc(scale_buffer_size);
+    clv_single = manager->acquire(manager->clv_single_buffer,
+                                  MemoryCategory::CLV, clv_single_size);
   } else {
-    scale_buffer = manager->scale_buffer_buffer.top();
-    manager->scale_buffer_buffer.pop();
+    clv = manager->acquire(manager->clv_buffer, MemoryCategory::CLV, clv_size);
+  }
 
-    std::memset(scale_buffer, 0, scale_buffer_size);
+  try {
+    scale_buffer = manager->acquire(manager->scale_buffer_buffer,
+                                    MemoryCategory::SCALER, scale_buffer_size);
+  } catch (...) {
+    return_clv();
+    throw;
   }
+
+  manager->memory_account->allocate(MemoryCategory::NODE,
+                                    sizeof(PhyloTreeNode));
+}
+
+PhyloTreeNode::PhyloTreeNode(PLLBufferManager *manager, std::string label,
+                             unsigned int tip_index)
+    : manager(manager), label(label), height(0.0), id(next_node_id++),
+      leaf_count(1), tip_index(tip_index), clv(nullptr), clv_single(nullptr),
+      scale_buffer(nullptr) {
+  manager->memory_account->allocate(MemoryCategory::NODE,
+                                    sizeof(PhyloTreeNode));
 }
 
 PhyloTreeNode::~PhyloTreeNode() {
-  manager->clv_buffer.push(clv);
-  manager->scale_buffer_buffer.push(scale_buffer);
+  // Leaf nodes use the tip clvs of the reference partitions and own no
+  // buffers.
+  if (edge_l && edge_r) {
+    return_clv();
+    manager->recycle(manager->scale_buffer_buffer, MemoryCategory::SCALER,
+                     scale_buffer);
+  }
+
+  manager->memory_account->release(MemoryCategory::NODE,
+                                   sizeof(PhyloTreeNode));
 
   clv = nullptr;
+  clv_single = nullptr;
   scale_buffer = nullptr;
 }
+
+void PhyloTreeNode::return_clv() {
+  // Double precision clvs are freed once the manager stores clvs in single
+  // precision, they would never be reused.
+  if (clv_single)
+    manager->recycle(manager->clv_single_buffer, MemoryCategory::CLV,
+                     clv_single);
+  else if (manager->clv_precision == CLVPrecision::SINGLE)
+    manager->release(manager->clv_buffer, MemoryCategory::CLV, clv);
+  else
+    manager->recycle(manager->clv_buffer, MemoryCategory::CLV, clv);
+}
+
+void print_tree(std::shared_ptr<PhyloTreeNode> root, std::ostream &stream) {
+  if (root->edge_l && root->edge_r) {
+    stream << "(";
+    print_tree(root->edge_l->child, stream);
+    stream << ":" << root->edge_l->length;
+    stream << ", ";
+    print_tree(root->edge_r->child, stream);
+    stream << ":" << root->edge_r->length;
+    stream << ")";
+  } else {
+    std::string label(root->label);
+    stream << label;
+  }
+}
@@ -0,0 +1,67 @@
+#include "pll_buffer_manager.h"
+
+#include <stdexcept>
+#include <string>
+
+/**
+   Frees and pops every buffer of 'stack'.
+ */
+template <typename T>
+void free_buffers(BufferStack<T> &stack, MemoryCategory category,
+                  MemoryAccount *memory_account) {
+  while (!stack.buffers.empty()) {
+    std::free(stack.buffers.top());
+    stack.buffers.pop();
+    memory_account->release_pooled(category, stack.buffer_size);
+  }
+}
+
+PLLBufferManager::PLLBufferManager()
+    : clv_precision(CLVPrecision::DOUBLE), memory_account(&own_account) {
+  own_account.add_manager(this);
+}
+
+PLLBufferManager::~PLLBufferManager() {
+  memory_account->remove_manager(this);
+  free_pooled_buffers();
+}
+
+void PLLBufferManager::set_memory_account(MemoryAccount *account) {
+  memory_account->remove_manager(this);
+  memory_account = account;
+  memory_account->add_manager(this);
+}
+
+void PLLBufferManager::free_pooled_buffers() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  free_buffers(clv_buffer, MemoryCategory::CLV, memory_account);
+  free_buffers(clv_single_buffer, MemoryCategory::CLV, memory_account);
+  free_buffers(pmatrix_buffer, MemoryCategory::PMATRIX, memory_account);
+  free_buffers(scale_buffer_buffer, MemoryCategory::SCALER, memory_account);
+}
+
+void PLLBufferManager::reserve(MemoryCategory category, size_t size) {
+  // Degrade early, while the double precision nodes still in use can be
+  // replaced before the budget itself is reached.
+  CLVPrecision precision = CLVPrecision::DOUBLE;
+  if (memory_account->exceeds_degrade_threshold(size) &&
+      clv_precision.compare_exchange_strong(precision, CLVPrecision::SINGLE)) {
+    memory_account->record_degradation();
+    std::lock_guard<std::mutex> lock(mutex);
+    free_buffers(clv_buffer, MemoryCategory::CLV, memory_account);
+  }
+
+  // The account is shared with other managers, whose pools count against the
+  // same budget.
+  if (memory_account->exceeds_budget(size))
+    memory_account->free_pooled_buffers();
+
+  if (memory_account->exceeds_budget(size)) {
+    throw std::runtime_error("Memory budget of " +
+                             std::to_string(memory_account->budget) +
+                             " bytes exceeded");
+  }
+
+  memory_account->allocate(category, size);
+}
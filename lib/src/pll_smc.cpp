@@ -1,166 +1,292 @@
 #include "pll_smc.h"
 
-/**
-   Creates a vector with 'count' number of particles, each using the given
-   vector of sequences.
-
-   Each particle starts with a weight of 1/'count'.
- */
-std::vector<Particle *> create_particles(
-    const unsigned int count,
-    const std::vector<std::pair<std::string, std::string>> sequences,
-    const pll_partition_t *reference_partition,
-    PLLBufferManager *const pll_buffer_manager) {
-  assert(sequences.size() > 0 && "Expected at least one sequence");
-  const unsigned int sequence_lengths = sequences[0].second.length();
-  for (auto &s : sequences) {
-    assert(s.second.length() == sequence_lengths &&
-           "Sequence lengths do not match");
-  }
+#include <algorithm>
+#include <atomic>
 
-  const double initial_weight = log(1.0 / (double)count);
+#include "smc_engine.h"
+#include "vector_math.h"
 
-  Particle particle = Particle(initial_weight, sequences, sequence_lengths,
-                               reference_partition, pll_buffer_manager);
-  std::vector<Particle *> particles(count * 2, nullptr);
-  for (auto &p : particles) {
-    p = new Particle(particle);
-  }
+NumaTopology numa_topology(const SMCOptions &options) {
+  if (options.fake_numa_nodes > 0)
+    return fake_numa_topology(options.fake_numa_nodes);
+  if (options.numa)
+    return detect_numa_topology();
 
-  return particles;
+  return NumaTopology();
 }
 
-/**
-
- */
-const pll_partition_t *create_reference_partition(
-    const std::vector<std::pair<std::string, std::string>> sequences) {
-  assert(sequences.size() > 0 && "Expected at least one sequence");
-  const unsigned int sequence_lengths = sequences[0].second.length();
-  for (auto &s : sequences) {
-    assert(s.second.length() == sequence_lengths &&
-           "Sequence lengths do not match");
-  }
-
-  const unsigned int rate_category_count = 4;
-  double rate_categories[4] = {0, 0, 0, 0};
-  pll_compute_gamma_cats(1, 4, rate_categories, PLL_GAMMA_RATES_MEAN);
-
-  const unsigned int subst_model_count = 1;
-  const double subst_params[6] = {1, 1, 1, 1, 1, 1};
-
-  const unsigned int nucleotide_states = 4;
-  const double nucleotide_frequencies[4] = {0.25, 0.25, 0.25, 0.25};
+std::unique_ptr<SMCEngine>
+run_smc(const unsigned int particle_count,
+        const std::vector<std::pair<std::string, std::string>> sequences,
+        const SMCOptions &options,
+        const std::vector<AlignmentPartition> &partitions) {
+  std::unique_ptr<SMCEngine> engine(new SMCEngine(options));
 
-  pll_partition *partition = pll_partition_create(
-      sequences.size(),
-      0, // Don't allocate any inner CLV's.
-      nucleotide_states, sequence_lengths, subst_model_count,
-      0, // Don't allocate any pmatrices.
-      rate_category_count,
-      0, // Don't allocate any scale buffers.
-      PLL_ATTRIB_ARCH_SSE);
+  engine->init(particle_count, sequences, partitions);
+  while (engine->step())
+    ;
 
-  assert(partition);
-  pll_set_frequencies(partition, 0, nucleotide_frequencies);
-  pll_set_category_rates(partition, rate_categories);
-  pll_set_subst_params(partition, 0, subst_params);
+  return engine;
+}
 
-  for (unsigned int i = 0; i < sequences.size(); i++) {
-    std::string sequence = sequences[i].second;
+double validate_single_precision(
+    const std::vector<std::pair<std::string, std::string>> sequences,
+    const unsigned int trial_count,
+    const std::vector<AlignmentPartition> &partitions) {
+  const ReferencePartitions reference_partitions(sequences, partitions);
+  const unsigned int sequence_lengths = sequences[0].second.length();
 
-    pll_set_tip_states(partition, i, pll_map_nt, sequence.data());
+  PLLBufferManager double_manager;
+  PLLBufferManager single_manager;
+  single_manager.clv_precision = CLVPrecision::SINGLE;
+
+  std::mt19937 mt_generator;
+  double max_difference = 0.0;
+
+  for (unsigned int trial = 0; trial < trial_count; trial++) {
+    PhyloForest double_forest(sequences, sequence_lengths, &reference_partitions,
+                              &double_manager);
+    PhyloForest single_forest(sequences, sequence_lengths, &reference_partitions,
+                              &single_manager);
+
+    while (double_forest.root_count() > 1) {
+      std::uniform_int_distribution<int> int_dist(
+          0, double_forest.root_count() - 1);
+      int i = int_dist(mt_generator);
+      int j = int_dist(mt_generator);
+      if (i == j)
+        continue;
+
+      double root_count = double_forest.root_count();
+      std::exponential_distribution<double> exponential_dist(
+          root_count * (root_count - 1) / 2);
+      double height = exponential_dist(mt_generator);
+
+      double double_ln_likelihood =
+          double_forest.connect(i, j, height)->ln_likelihood;
+      double single_ln_likelihood =
+          single_forest.connect(i, j, height)->ln_likelihood;
+
+      max_difference = std::max(
+          max_difference, fabs(double_ln_likelihood - single_ln_likelihood));
+    }
   }
 
-  // Once for each param index
-  pll_update_eigen(partition, 0);
-
-
-  return partition;
+  return max_difference;
 }
 
-std::vector<Particle *>
-run_smc(const unsigned int particle_count,
-        const std::vector<std::pair<std::string, std::string>> sequences) {
-
-  const pll_partition_t *reference_partition =
-      create_reference_partition(sequences);
-  PLLBufferManager *pll_buffer_manager = new PLLBufferManager;
+unsigned int
+place_offspring(std::vector<unsigned int> &ancestors,
+                const std::vector<unsigned int> &generation_shards,
+                const std::vector<unsigned int> &next_generation_shards) {
+  const unsigned int shard_count = next_generation_shards.size() - 1;
+
+  std::vector<unsigned int> placed(ancestors.size());
+  std::vector<unsigned int> free_slots(shard_count);
+  std::vector<unsigned int> moved;
+
+  auto ancestor = ancestors.begin();
+  for (unsigned int shard = 0; shard < shard_count; shard++) {
+    unsigned int slot = next_generation_shards[shard];
+    unsigned int end = next_generation_shards[shard + 1];
+
+    for (; ancestor != ancestors.end() &&
+           *ancestor < generation_shards[shard + 1];
+         ancestor++) {
+      if (slot < end)
+        placed[slot++] = *ancestor;
+      else
+        moved.push_back(*ancestor);
+    }
+
+    free_slots[shard] = slot;
+  }
 
-  std::vector<Particle *> particles = create_particles(
-      particle_count, sequences, reference_partition, pll_buffer_manager);
+  auto next_moved = moved.begin();
+  for (unsigned int shard = 0; shard < shard_count; shard++) {
+    for (unsigned int slot = free_slots[shard];
+         slot < next_generation_shards[shard + 1]; slot++)
+      placed[slot] = *next_moved++;
+  }
+  assert(next_moved == moved.end() && "Expected a slot for every offspring");
 
-  const unsigned int sequence_count = sequences.size();
-  const unsigned int iterations = sequence_count - 1;
+  ancestors.swap(placed);
 
-  for (int i = 0; i < iterations; i++) {
-    std::cerr << "Iteration " << i << std::endl;
+  return moved.size();
+}
 
-    resample(particles, i);
-    propose(particles, i);
-    normalize_weights(particles, i);
+/**
+   Number of particles whose proposals are made together. Small enough for
+   the new pmatrices to still be in cache when the CLVs are computed.
+ */
+const unsigned int proposal_batch_size = 64;
+
+double iterate(const std::vector<Particle *> &generation,
+               std::vector<Particle *> &next_generation,
+               const SMCOptions &options, ThreadPool &thread_pool,
+               const std::vector<unsigned int> &generation_shards,
+               const std::vector<unsigned int> &next_generation_shards) {
+  const unsigned int count = next_generation.size();
+  const bool sharded = next_generation_shards.size() > 2;
+  assert(generation_shards.size() == next_generation_shards.size() &&
+         "Expected the same shards in both generations");
+  assert(next_generation_shards.size() <= thread_pool.node_count() + 1 &&
+         "Expected at most one shard per NUMA node");
+
+  std::vector<double> weights(generation.size());
+  for (unsigned int i = 0; i < generation.size(); i++)
+    weights[i] = generation[i]->normalized_weight;
+
+  // Sorted ancestors keep copies of the same ancestor next to each other.
+  std::random_device random;
+  std::discrete_distribution<unsigned int> dist(weights.begin(), weights.end());
+  std::vector<unsigned int> ancestors(count);
+  for (auto &ancestor : ancestors)
+    ancestor = dist(random);
+  std::sort(ancestors.begin(), ancestors.end());
+
+  unsigned int moved = 0;
+  if (sharded)
+    moved = place_offspring(ancestors, generation_shards,
+                            next_generation_shards);
+
+  weights.resize(count);
+
+  // Contiguous blocks of particles, one per thread of the shard's node.
+  std::vector<unsigned int> block_begins;
+  std::vector<unsigned int> block_nodes;
+  if (sharded) {
+    for (unsigned int shard = 0; shard + 1 < next_generation_shards.size();
+         shard++) {
+      unsigned int begin = next_generation_shards[shard];
+      unsigned int end = next_generation_shards[shard + 1];
+      unsigned int threads = std::min(thread_pool.node_size(shard),
+                                      std::max(1u, end - begin));
+
+      for (unsigned int block = 0; block < threads; block++) {
+        block_begins.push_back(begin + (end - begin) * block / threads);
+        block_nodes.push_back(shard);
+      }
+    }
+  } else {
+    const unsigned int block_count = std::min(thread_pool.size(), count);
+    for (unsigned int block = 0; block < block_count; block++)
+      block_begins.push_back(count * block / block_count);
   }
+  block_begins.push_back(count);
+  const unsigned int block_count = block_begins.size() - 1;
+
+  std::vector<double> block_max(block_count, -DBL_MAX);
+  std::vector<double> block_sum(block_count, 0.0);
+  std::atomic<unsigned int> accepted(0);
+  std::atomic<unsigned int> proposed(0);
+
+  auto run_block = [&](unsigned int block) {
+    double max = -DBL_MAX;
+    double sum = 0.0;
+    double exponentials[proposal_batch_size];
+
+    // The pmatrices of the new edges of a batch are built together.
+    const unsigned int block_end = block_begins[block + 1];
+    for (unsigned int begin = block_begins[block]; begin < block_end;
+         begin += proposal_batch_size) {
+      const unsigned int end = std::min(begin + proposal_batch_size, block_end);
+
+      unsigned int batch_proposed = 0;
+      for (unsigned int i = begin; i < end; i++) {
+        Particle *particle = next_generation[i];
+        *particle = *generation[ancestors[i]];
+
+        if (options.rejuvenation_moves > 0)
+          accepted +=
+              particle->rejuvenate(options.rejuvenation_moves, batch_proposed);
+      }
+      proposed += batch_proposed;
+
+      Particle::propose_all(&next_generation[begin], end - begin);
+
+      // Running log-sum-exp relative to the largest weight seen so far,
+      // with the exponentials of a batch computed together.
+      double batch_max = -DBL_MAX;
+      for (unsigned int i = begin; i < end; i++) {
+        weights[i] = next_generation[i]->weight;
+        batch_max = std::max(batch_max, weights[i]);
+      }
+      if (batch_max > max) {
+        sum *= exp(max - batch_max);
+        max = batch_max;
+      }
+
+      for (unsigned int i = begin; i < end; i++)
+        exponentials[i - begin] = weights[i] - max;
+      exp_in_place(exponentials, end - begin);
+      for (unsigned int i = begin; i < end; i++)
+        sum += exponentials[i - begin];
+    }
+
+    block_max[block] = max;
+    block_sum[block] = sum;
+  };
+
+  if (sharded)
+    thread_pool.run_on_nodes(block_nodes, run_block);
+  else
+    thread_pool.parallel_for(0, block_count, run_block);
+
+  // Moves which couldn't change the picked part of a forest weren't
+  // proposed and don't count as rejected.
+  if (options.progress && options.rejuvenation_moves > 0 && proposed > 0)
+    std::cerr << "Rejuvenation acceptance: " << (double)accepted / proposed
+              << " of " << proposed << " proposed moves" << std::endl;
+
+  if (options.progress && sharded)
+    std::cerr << "Offspring moved between NUMA nodes: " << moved << std::endl;
+
+  double max = *std::max_element(block_max.begin(), block_max.end());
+  double sum = 0.0;
+  for (unsigned int block = 0; block < block_count; block++)
+    sum += block_sum[block] * exp(block_max[block] - max);
+  const double ln_normalizer = max + log(sum);
 
-  return particles;
-}
-
-void resample(std::vector<Particle *> &particles,
-              const unsigned int iteration) {
-  int offset = iteration % 2 == 0 ? 0 : particles.size() / 2;
+  for (unsigned int i = 0; i < count; i++)
+    weights[i] -= ln_normalizer;
+  exp_in_place(weights.data(), count);
 
-  std::vector<double> normalized_weights;
   double ess_sum = 0.0;
-  for (int i = offset; i < particles.size() / 2 + offset; i++) {
-    double normalized_weight = particles[i]->normalized_weight;
+  for (unsigned int i = 0; i < count; i++)
+    ess_sum += weights[i] * weights[i];
 
-    normalized_weights.push_back(normalized_weight);
-    ess_sum += normalized_weight * normalized_weight;
+  for (unsigned int i = 0; i < count; i++)
+    next_generation[i]->normalized_weight = weights[i];
 
-    assert(normalized_weight <= 1.0);
-    assert(ess_sum <= 1);
-  }
   double ess = 1 / ess_sum;
+  if (options.progress)
+    std::cerr << "ESS: " << ess << ", particles: " << count << std::endl;
 
-  std::cerr << "ESS: " << ess << std::endl;
-
-  std::random_device random;
-  std::discrete_distribution<int> dist(normalized_weights.begin(),
-                                       normalized_weights.end());
-
-  for (int i = particles.size() / 2 - offset; i < particles.size() - offset;
-       i++) {
-    int index = dist(random);
-
-    *particles[i] = *particles[index + offset];
-  }
+  return ess;
 }
 
-void propose(std::vector<Particle *> &particles, const unsigned int iteration) {
-  int offset = iteration % 2 == 0 ? particles.size() / 2 : 0;
-
-  for (int i = offset; i < particles.size() / 2 + offset; i++) {
-    particles[i]->propose();
-  }
-}
+unsigned int adapt_particle_count(const unsigned int count, const double ess,
+                                  const SMCOptions &options) {
+  if (options.target_ess <= 0.0)
+    return count;
 
-void normalize_weights(std::vector<Particle *> &particles,
-                       const unsigned int iteration) {
-  int offset = iteration % 2 == 0 ? particles.size() / 2 : 0;
+  // Assume the next generation keeps the current ratio of ESS to count, but
+  // change the count by at most a factor of two to damp single outliers.
+  double adapted_count = ceil(options.target_ess * count / ess);
+  adapted_count = std::min(adapted_count, 2.0 * count);
+  adapted_count = std::max(adapted_count, 0.5 * count);
+  adapted_count = std::max(adapted_count, (double)options.min_particle_count);
+  adapted_count = std::min(adapted_count, (double)options.max_particle_count);
 
-  double max = -DBL_MAX;
-  for (int i = offset; i < particles.size() / 2 + offset; i++) {
-    if (particles[i]->weight > max)
-      max = particles[i]->weight;
-  }
+  return adapted_count;
+}
 
-  double sum = 0.0;
-  for (int i = offset; i < particles.size() / 2 + offset; i++) {
-    particles[i]->normalized_weight = particles[i]->weight - max;
-    sum += exp(particles[i]->normalized_weight);
-  }
+unsigned int initial_particle_count(const unsigned int count,
+                                    const SMCOptions &options) {
+  if (options.target_ess <= 0.0)
+    return count;
 
-  for (int i = offset; i < particles.size() / 2 + offset; i++) {
-    particles[i]->normalized_weight =
-        exp(particles[i]->normalized_weight) / sum;
-  }
+  return std::min(std::max(count, options.min_particle_count),
+                  options.max_particle_count);
 }
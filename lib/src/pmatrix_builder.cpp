@@ -0,0 +1,140 @@
+#include "pmatrix_builder.h"
+
+#include <algorithm>
+
+#include "vector_math.h"
+
+/**
+   Number of edges whose exponentials are computed together.
+ */
+const unsigned int tile_edges = 64;
+
+/**
+   Writes the pmatrix V^-1 diag('expd') V of a rate category into 'pmat',
+   summing in the same order as PLL.
+ */
+void multiply_eigen(const double *inv_evecs, const double *expd,
+                    const double *evecs, double *pmat,
+                    const unsigned int states,
+                    const unsigned int states_padded) {
+  for (unsigned int j = 0; j < states; j++) {
+    double *row = pmat + j * states_padded;
+    std::fill(row, row + states, 0.0);
+
+    for (unsigned int m = 0; m < states; m++) {
+      const double factor = inv_evecs[j * states_padded + m] * expd[m];
+      for (unsigned int k = 0; k < states; k++)
+        row[k] += factor * evecs[m * states_padded + k];
+    }
+  }
+}
+
+/**
+   Same as above with the number of states known at compile time, which lets
+   a row of the pmatrix be accumulated in registers.
+ */
+template <unsigned int STATES>
+void multiply_eigen(const double *inv_evecs, const double *expd,
+                    const double *evecs, double *pmat,
+                    const unsigned int states_padded) {
+  for (unsigned int j = 0; j < STATES; j++) {
+    double row[STATES] = {};
+
+    for (unsigned int m = 0; m < STATES; m++) {
+      const double factor = inv_evecs[j * states_padded + m] * expd[m];
+      for (unsigned int k = 0; k < STATES; k++)
+        row[k] += factor * evecs[m * states_padded + k];
+    }
+
+    std::copy(row, row + STATES, pmat + j * states_padded);
+  }
+}
+
+PMatrixBuilder::PMatrixBuilder()
+    : states(0), states_padded(0), rate_cats(0), partition_count(0) {}
+
+PMatrixBuilder::PMatrixBuilder(const std::vector<pll_partition_t *> &partitions)
+    : states(partitions[0]->states),
+      states_padded(partitions[0]->states_padded),
+      rate_cats(partitions[0]->rate_cats),
+      partition_count(partitions.size()) {
+  const unsigned int matrix_size = states * states_padded;
+
+  for (const pll_partition_t *p : partitions) {
+    assert(p->states == states && p->rate_cats == rate_cats &&
+           "Expected the same states and rate categories in all partitions");
+
+    // Only parameter index 0 is used, see create_reference_partition.
+    const double prop_invar = p->prop_invar[0];
+    for (unsigned int n = 0; n < rate_cats; n++) {
+      for (unsigned int s = 0; s < states; s++) {
+        double scaled = p->eigenvals[0][s] * p->rates[n];
+        if (prop_invar > PLL_MISC_EPSILON)
+          scaled /= 1.0 - prop_invar;
+        scaled_eigenvals.push_back(scaled);
+      }
+    }
+
+    eigenvecs.insert(eigenvecs.end(), p->eigenvecs[0],
+                     p->eigenvecs[0] + matrix_size);
+    inv_eigenvecs.insert(inv_eigenvecs.end(), p->inv_eigenvecs[0],
+                         p->inv_eigenvecs[0] + matrix_size);
+  }
+}
+
+void PMatrixBuilder::build(const double *lengths, double *const *pmatrices,
+                           const unsigned int count) const {
+  const unsigned int edge_exponents = scaled_eigenvals.size();
+  const unsigned int matrix_size = states * states_padded;
+
+  thread_local std::vector<double> expd;
+  expd.resize(tile_edges * edge_exponents);
+
+  for (unsigned int first = 0; first < count; first += tile_edges) {
+    const unsigned int tile_count = std::min(tile_edges, count - first);
+
+    for (unsigned int e = 0; e < tile_count; e++) {
+      assert(lengths[first + e] >= 0 && "Branch length can't be negative");
+
+      const double length = lengths[first + e];
+      double *edge_expd = expd.data() + e * edge_exponents;
+      for (unsigned int k = 0; k < edge_exponents; k++)
+        edge_expd[k] = scaled_eigenvals[k] * length;
+    }
+
+    exp_in_place(expd.data(), tile_count * edge_exponents);
+
+    for (unsigned int e = 0; e < tile_count; e++) {
+      double *pmat = pmatrices[first + e];
+
+      // Like PLL, a zero branch length gives exactly the identity.
+      if (!lengths[first + e]) {
+        for (unsigned int m = 0; m < partition_count * rate_cats; m++) {
+          for (unsigned int j = 0; j < states; j++)
+            for (unsigned int k = 0; k < states; k++)
+              pmat[j * states_padded + k] = j == k ? 1 : 0;
+          pmat += matrix_size;
+        }
+        continue;
+      }
+
+      const double *edge_expd = expd.data() + e * edge_exponents;
+      for (unsigned int i = 0; i < partition_count; i++) {
+        const double *evecs = eigenvecs.data() + i * matrix_size;
+        const double *inv_evecs = inv_eigenvecs.data() + i * matrix_size;
+
+        for (unsigned int n = 0; n < rate_cats; n++) {
+          const double *cat_expd = edge_expd + (i * rate_cats + n) * states;
+
+          if (states == 4)
+            multiply_eigen<4>(inv_evecs, cat_expd, evecs, pmat, states_padded);
+          else
+            multiply_eigen(inv_evecs, cat_expd, evecs, pmat, states,
+                           states_padded);
+
+          pmat += matrix_size;
+        }
+      }
+    }
+  }
+}
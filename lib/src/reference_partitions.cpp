@@ -0,0 +1,168 @@
+#include "reference_partitions.h"
+
+#include <algorithm>
+#include <cctype>
+
+/**
+   Smallest number of sites worth a task of its own.
+ */
+const unsigned int min_task_sites = 1000;
+
+std::vector<AlignmentPartition>
+default_partitions(const unsigned int column_count) {
+  AlignmentPartition partition;
+  partition.name = "alignment";
+  partition.gamma_rates = true;
+  for (unsigned int c = 0; c < column_count; c++)
+    partition.columns.push_back(c);
+
+  return {partition};
+}
+
+/**
+   Counts the frequencies of A, C, G and T in the partition's columns.
+   Ambiguous characters are ignored.
+ */
+void count_frequencies(
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    const AlignmentPartition &partition, double *frequencies) {
+  const std::string nucleotides = "ACGT";
+  double counts[4] = {0, 0, 0, 0};
+  double total = 0;
+
+  for (auto &s : sequences) {
+    for (unsigned int c : partition.columns) {
+      size_t state = nucleotides.find(std::toupper(s.second[c]));
+      if (state == std::string::npos)
+        continue;
+
+      counts[state]++;
+      total++;
+    }
+  }
+
+  for (unsigned int i = 0; i < 4; i++)
+    frequencies[i] = total > 0 ? counts[i] / total : 0.25;
+}
+
+/**
+   Creates a PLL partition holding the tip CLVs of the partition's columns
+   and its substitution model.
+ */
+pll_partition_t *create_reference_partition(
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    const AlignmentPartition &alignment_partition) {
+  assert(alignment_partition.columns.size() > 0 &&
+         "Expected at least one column");
+
+  const unsigned int rate_category_count = 4;
+  double rate_categories[4] = {1, 1, 1, 1};
+  if (alignment_partition.gamma_rates)
+    pll_compute_gamma_cats(alignment_partition.gamma_alpha, 4,
+                           rate_categories, PLL_GAMMA_RATES_MEAN);
+
+  const unsigned int subst_model_count = 1;
+
+  const unsigned int nucleotide_states = 4;
+  double nucleotide_frequencies[4];
+  if (alignment_partition.empirical_frequencies) {
+    count_frequencies(sequences, alignment_partition, nucleotide_frequencies);
+  } else {
+    std::copy(alignment_partition.frequencies,
+              alignment_partition.frequencies + 4, nucleotide_frequencies);
+  }
+
+  pll_partition *partition = pll_partition_create(
+      sequences.size(),
+      0, // Don't allocate any inner CLV's.
+      nucleotide_states, alignment_partition.columns.size(),
+      subst_model_count,
+      0, // Don't allocate any pmatrices.
+      rate_category_count,
+      0, // Don't allocate any scale buffers.
+      PLL_ATTRIB_ARCH_SSE);
+
+  assert(partition);
+  pll_set_frequencies(partition, 0, nucleotide_frequencies);
+  pll_set_category_rates(partition, rate_categories);
+  pll_set_subst_params(partition, 0, alignment_partition.subst_params);
+
+  std::string sequence(alignment_partition.columns.size(), '-');
+  for (unsigned int i = 0; i < sequences.size(); i++) {
+    for (unsigned int k = 0; k < alignment_partition.columns.size(); k++)
+      sequence[k] = sequences[i].second[alignment_partition.columns[k]];
+
+    pll_set_tip_states(partition, i, pll_map_nt, sequence.data());
+  }
+
+  // Once for each param index
+  pll_update_eigen(partition, 0);
+
+  return partition;
+}
+
+ReferencePartitions::ReferencePartitions(
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    std::vector<AlignmentPartition> alignment_partitions,
+    ThreadPool *thread_pool)
+    : site_count(0), thread_pool(thread_pool) {
+  assert(sequences.size() > 0 && "Expected at least one sequence");
+  const unsigned int sequence_lengths = sequences[0].second.length();
+  for (auto &s : sequences) {
+    assert(s.second.length() == sequence_lengths &&
+           "Sequence lengths do not match");
+  }
+
+  if (alignment_partitions.empty())
+    alignment_partitions = default_partitions(sequence_lengths);
+
+  for (auto &alignment_partition : alignment_partitions) {
+    for (unsigned int c : alignment_partition.columns)
+      assert(c < sequence_lengths && "Partition column out of bounds");
+
+    partitions.push_back(
+        create_reference_partition(sequences, alignment_partition));
+    site_offsets.push_back(site_count);
+    site_count += partitions.back()->sites;
+  }
+
+  pmatrix_builder = PMatrixBuilder(partitions);
+
+  // Aim for one task per thread, unless tasks would get too small.
+  unsigned int thread_count = thread_pool ? thread_pool->size() : 1;
+  unsigned int target_task_count = std::max(
+      1u, std::min(thread_count, site_count / min_task_sites));
+  unsigned int chunk_sites =
+      (site_count + target_task_count - 1) / target_task_count;
+
+  std::vector<Chunk> chunks;
+  for (unsigned int i = 0; i < partitions.size(); i++) {
+    unsigned int sites = partitions[i]->sites;
+    unsigned int chunk_count = (sites + chunk_sites - 1) / chunk_sites;
+
+    for (unsigned int k = 0; k < chunk_count; k++)
+      chunks.push_back(
+          {i, sites * k / chunk_count, sites * (k + 1) / chunk_count});
+  }
+
+  // Longest chunk first onto the task with the fewest sites so far.
+  std::sort(chunks.begin(), chunks.end(), [](const Chunk &a, const Chunk &b) {
+    return a.end - a.begin > b.end - b.begin;
+  });
+
+  tasks.resize(target_task_count);
+  std::vector<unsigned int> task_sites(target_task_count, 0);
+  for (auto &chunk : chunks) {
+    unsigned int task =
+        std::min_element(task_sites.begin(), task_sites.end()) -
+        task_sites.begin();
+
+    tasks[task].push_back(chunk);
+    task_sites[task] += chunk.end - chunk.begin;
+  }
+}
+
+ReferencePartitions::~ReferencePartitions() {
+  for (auto &partition : partitions)
+    pll_partition_destroy(partition);
+}
@@ -0,0 +1,222 @@
+#include "smc_engine.h"
+
+#include <algorithm>
+#include <sstream>
+
+SMCEngine::SMCEngine(const SMCOptions &options)
+    : options(options),
+      thread_pool(options.thread_count, numa_topology(options)) {
+  memory_account.budget = options.memory_budget;
+  memory_account.degrade_on_budget = options.degrade_on_memory_budget;
+}
+
+SMCEngine::~SMCEngine() {
+  // Particles must return their buffers before the pools are freed.
+  finish_job(job);
+}
+
+PLLBufferManager *
+SMCEngine::buffer_manager(const ReferencePartitions &partitions,
+                          const unsigned int node) {
+  std::tuple<unsigned int, unsigned int, unsigned int> key(
+      partitions.clv_length(), partitions.pmatrix_length(), node);
+
+  std::lock_guard<std::mutex> lock(buffer_pools_mutex);
+
+  BufferPool &pool = buffer_pools[key];
+  if (!pool.manager) {
+    pool.manager.reset(new PLLBufferManager);
+    pool.manager->clv_precision = options.clv_precision;
+    pool.manager->set_memory_account(&memory_account);
+  }
+  pool.job_count++;
+
+  return pool.manager.get();
+}
+
+void SMCEngine::release_buffer_managers(
+    const std::vector<PLLBufferManager *> &managers) {
+  std::lock_guard<std::mutex> lock(buffer_pools_mutex);
+
+  for (auto &entry : buffer_pools) {
+    if (std::find(managers.begin(), managers.end(),
+                  entry.second.manager.get()) != managers.end())
+      entry.second.job_count--;
+  }
+
+  for (auto entry = buffer_pools.begin(); entry != buffer_pools.end();) {
+    bool unused = entry->second.job_count == 0 &&
+                  std::find(managers.begin(), managers.end(),
+                            entry->second.manager.get()) == managers.end();
+    if (unused)
+      entry = buffer_pools.erase(entry);
+    else
+      entry++;
+  }
+}
+
+void SMCEngine::init_job(
+    Job &job, const unsigned int particle_count,
+    const std::vector<std::pair<std::string, std::string>> sequences,
+    const std::vector<AlignmentPartition> &partitions,
+    const SMCOptions &job_options) {
+  finish_job(job);
+
+  job.reference_partitions =
+      new ReferencePartitions(sequences, partitions, &thread_pool);
+  std::vector<unsigned int> shard_weights;
+  for (unsigned int node = 0; node < thread_pool.node_count(); node++) {
+    job.pll_buffer_managers.push_back(
+        buffer_manager(*job.reference_partitions, node));
+    shard_weights.push_back(thread_pool.node_size(node));
+  }
+  if (job_options.distance_proposal)
+    job.distance_matrix = new DistanceMatrix(sequences, thread_pool);
+  const unsigned int initial_count =
+      initial_particle_count(particle_count, job_options);
+  job.population = new ParticlePopulation(
+      initial_count, sequences, job.reference_partitions,
+      job.pll_buffer_managers, job.distance_matrix, shard_weights,
+      &thread_pool);
+  job.iteration = 0;
+  job.iterations = sequences.size() - 1;
+  job.next_particle_count = initial_count;
+}
+
+bool SMCEngine::step_job(Job &job, const SMCOptions &job_options) {
+  if (job.iteration >= job.iterations)
+    return false;
+
+  if (job_options.progress)
+    std::cerr << "Iteration " << job.iteration << std::endl;
+
+  ParticlePopulation *population = job.population;
+
+  population->resize_next_generation(job.next_particle_count);
+  double ess = iterate(population->get_generation(),
+                       population->get_next_generation(), job_options,
+                       thread_pool, population->get_generation_shards(),
+                       population->get_next_generation_shards());
+  population->advance();
+
+  if (job_options.progress) {
+    if (memory_account.take_degradation())
+      std::cerr << "Memory use is close to the budget, storing CLVs in single "
+                   "precision"
+                << std::endl;
+    memory_account.report(std::cerr);
+    memory_account.reset_peaks();
+  }
+
+  job.next_particle_count =
+      adapt_particle_count(job.next_particle_count, ess, job_options);
+  job.iteration++;
+
+  return job.iteration < job.iterations;
+}
+
+std::vector<SMCTree> SMCEngine::finish_job(Job &job) {
+  std::vector<SMCTree> trees;
+  if (!job.reference_partitions)
+    return trees;
+
+  // A job which failed during 'init_job' may not have any particles.
+  std::vector<Particle *> particles;
+  if (job.population)
+    particles = job.population->get_generation();
+
+  for (auto &particle : particles) {
+    if (particle->get_forest()->root_count() > 1)
+      continue;
+
+    std::ostringstream newick;
+    print_tree(particle->get_roots().front(), newick);
+
+    trees.push_back(
+        {particle->weight, particle->normalized_weight, newick.str()});
+  }
+
+  delete job.population;
+  job.population = nullptr;
+
+  delete job.reference_partitions;
+  delete job.distance_matrix;
+  job.reference_partitions = nullptr;
+  release_buffer_managers(job.pll_buffer_managers);
+  job.pll_buffer_managers.clear();
+  job.distance_matrix = nullptr;
+
+  return trees;
+}
+
+void SMCEngine::init(
+    const unsigned int particle_count,
+    const std::vector<std::pair<std::string, std::string>> sequences,
+    const std::vector<AlignmentPartition> &partitions) {
+  init_job(job, particle_count, sequences, partitions, options);
+}
+
+bool SMCEngine::step() { return step_job(job, options); }
+
+std::vector<SMCTree> SMCEngine::finish() { return finish_job(job); }
+
+std::vector<SMCTree>
+SMCEngine::run(const unsigned int particle_count,
+               const std::vector<std::pair<std::string, std::string>> sequences,
+               const std::vector<AlignmentPartition> &partitions) {
+  init(particle_count, sequences, partitions);
+  while (step())
+    ;
+
+  return finish();
+}
+
+std::vector<std::vector<SMCTree>> SMCEngine::run_batch(
+    const unsigned int particle_count,
+    const std::vector<std::vector<std::pair<std::string, std::string>>>
+        &alignments,
+    const std::vector<std::vector<AlignmentPartition>> &partitions) {
+  assert((partitions.empty() || partitions.size() == alignments.size()) &&
+         "Expected partitions for every alignment");
+
+  std::vector<std::vector<SMCTree>> results(alignments.size());
+
+  SMCOptions batch_options = options;
+  batch_options.progress = false;
+
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  std::atomic<unsigned int> pending(alignments.size());
+  for (unsigned int i = 0; i < alignments.size(); i++) {
+    thread_pool.submit([this, i, particle_count, &alignments, &partitions,
+                        &results, &batch_options, &pending, &error,
+                        &error_mutex]() {
+      Job batch_job;
+      try {
+        init_job(batch_job, particle_count, alignments[i],
+                 partitions.empty() ? std::vector<AlignmentPartition>()
+                                    : partitions[i],
+                 batch_options);
+        while (step_job(batch_job, batch_options))
+          ;
+        results[i] = finish_job(batch_job);
+      } catch (...) {
+        finish_job(batch_job);
+
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+
+      pending--;
+    }, pending);
+  }
+
+  thread_pool.wait(pending);
+
+  if (error)
+    std::rethrow_exception(error);
+
+  return results;
+}
@@ -0,0 +1,195 @@
+#include "thread_pool.h"
+
+thread_local unsigned int ThreadPool::thread_node = 0;
+
+ThreadPool::ThreadPool(const unsigned int thread_count,
+                       const NumaTopology &topology)
+    : topology(topology), stopping(false) {
+  const unsigned int threads = resolve_thread_count(thread_count);
+  const unsigned int nodes = std::min(threads, topology.node_count());
+
+  node_thread_counts.resize(nodes, 0);
+  tasks.resize(nodes);
+  idle_workers.resize(nodes, 0);
+  woken_workers.resize(nodes, 0);
+  task_available = std::vector<std::condition_variable>(nodes);
+
+  // Thread zero is the calling thread.
+  for (unsigned int i = 0; i < threads; i++)
+    node_thread_counts[i * nodes / threads]++;
+
+  thread_node = 0;
+  creator = std::this_thread::get_id();
+  if (!this->topology.node_cpus.empty()) {
+    creator_cpus = available_cpus();
+    pin_thread(this->topology, 0);
+  }
+
+  for (unsigned int i = 1; i < threads; i++)
+    workers.emplace_back(&ThreadPool::work, this, i * nodes / threads);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  for (auto &available : task_available)
+    available.notify_all();
+
+  for (auto &worker : workers)
+    worker.join();
+
+  if (!creator_cpus.empty() && std::this_thread::get_id() == creator)
+    set_thread_cpus(creator_cpus);
+}
+
+void ThreadPool::work(const unsigned int node) {
+  thread_node = node;
+  pin_thread(topology, node);
+
+  while (true) {
+    std::function<void()> task;
+    bool stealable_tasks = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      auto runnable = [this, node]() {
+        if (stopping || !tasks[node].empty())
+          return true;
+
+        for (unsigned int other = 0; other < tasks.size(); other++) {
+          if (stealable(other))
+            return true;
+        }
+        return false;
+      };
+
+      idle_workers[node]++;
+      while (!runnable()) {
+        task_available[node].wait(lock);
+
+        // 'submit' counts a worker it wakes as woken instead of idle until
+        // any worker of the node has woken up.
+        if (woken_workers[node] > 0) {
+          woken_workers[node]--;
+          idle_workers[node]++;
+        }
+      }
+      idle_workers[node]--;
+
+      if (!pop_task(node, nullptr, task))
+        return;
+
+      // With this worker busy, threads waiting in other nodes may now take
+      // the remaining tasks of its node.
+      for (unsigned int other = 0; other < tasks.size(); other++)
+        stealable_tasks = stealable_tasks || stealable(other);
+    }
+    if (stealable_tasks)
+      task_finished.notify_all();
+
+    task();
+    notify_finished();
+  }
+}
+
+bool ThreadPool::pop_task(const unsigned int node,
+                          const std::atomic<unsigned int> *group,
+                          std::function<void()> &task) {
+  for (unsigned int i = 0; i < tasks.size(); i++) {
+    const unsigned int queue_node = (node + i) % tasks.size();
+    if (i > 0 && !stealable(queue_node))
+      continue;
+
+    std::deque<Task> &queue = tasks[queue_node];
+    auto found = std::find_if(queue.begin(), queue.end(),
+                              [group](const Task &queued) {
+                                return !group || queued.group == group;
+                              });
+    if (found == queue.end())
+      continue;
+
+    task = std::move(found->function);
+    queue.erase(found);
+    return true;
+  }
+
+  return false;
+}
+
+bool ThreadPool::run_pending_task(const std::atomic<unsigned int> &group) {
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!pop_task(thread_node % tasks.size(), &group, task))
+      return false;
+  }
+
+  task();
+  notify_finished();
+
+  return true;
+}
+
+void ThreadPool::notify_finished() {
+  // Taking the lock orders the task's completion before any waiter's check.
+  { std::lock_guard<std::mutex> lock(mutex); }
+  task_finished.notify_all();
+}
+
+void ThreadPool::submit(std::function<void()> task,
+                        const std::atomic<unsigned int> &pending) {
+  submit(std::move(task), pending, thread_node % tasks.size());
+}
+
+void ThreadPool::submit(std::function<void()> task,
+                        const std::atomic<unsigned int> &pending,
+                        const unsigned int node) {
+  bool woken = false;
+  unsigned int woken_node = node;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks[node].push_back({std::move(task), &pending});
+
+    // Wake a thread of another node only if all threads of 'node' are busy.
+    for (unsigned int i = 0; i < tasks.size() && !woken; i++) {
+      woken_node = (node + i) % tasks.size();
+      if (idle_workers[woken_node] > 0) {
+        idle_workers[woken_node]--;
+        woken_workers[woken_node]++;
+        woken = true;
+      }
+    }
+  }
+  if (woken)
+    task_available[woken_node].notify_one();
+  task_finished.notify_all();
+}
+
+void ThreadPool::wait(const std::atomic<unsigned int> &pending) {
+  while (pending > 0) {
+    if (run_pending_task(pending))
+      continue;
+
+    // Tasks of other groups are left to the workers, running them here would
+    // nest them on this thread's stack and delay the return.
+    std::unique_lock<std::mutex> lock(mutex);
+    task_finished.wait(lock, [this, &pending]() {
+      if (pending == 0)
+        return true;
+
+      const unsigned int node = thread_node % tasks.size();
+      for (unsigned int other = 0; other < tasks.size(); other++) {
+        if (other != node && !stealable(other))
+          continue;
+
+        for (const Task &task : tasks[other]) {
+          if (task.group == &pending)
+            return true;
+        }
+      }
+      return false;
+    });
+  }
+}
@@ -0,0 +1,96 @@
+#include "vector_math.h"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+   Constants of 'exp_in_place'. Adding 'round_shift', 1.5 * 2^52, to a double
+   rounds it to an integer which is kept in the low mantissa bits.
+ */
+const double exp_min = -708.0;
+const double exp_max = 709.0;
+const double log2e = 1.4426950408889634;
+const double ln2_hi = 6.93147180369123816490e-01;
+const double ln2_lo = 1.90821492927058770002e-10;
+const double round_shift = 6755399441055744.0;
+const std::int64_t round_shift_bits = 0x4338000000000000;
+
+/**
+   Taylor coefficients 1 / k! for k = 12 down to 0.
+ */
+const double exp_coefficients[13] = {
+    1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0,
+    1.0 / 40320.0,     1.0 / 5040.0,     1.0 / 720.0,     1.0 / 120.0,
+    1.0 / 24.0,        1.0 / 6.0,        0.5,             1.0,
+    1.0};
+
+/**
+   Exponential of a single value, see 'exp_in_place'.
+ */
+inline double exp_scalar(double x) {
+  x = x > exp_min ? x : exp_min;
+  x = x < exp_max ? x : exp_max;
+
+  double shifted = x * log2e + round_shift;
+  double n = shifted - round_shift;
+  double r = (x - n * ln2_hi) - n * ln2_lo;
+
+  double p = exp_coefficients[0];
+  for (unsigned int i = 1; i < 13; i++)
+    p = p * r + exp_coefficients[i];
+
+  // 2^n built directly in the exponent bits.
+  std::int64_t scale_bits;
+  std::memcpy(&scale_bits, &shifted, sizeof(double));
+  scale_bits = (scale_bits - round_shift_bits + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &scale_bits, sizeof(double));
+
+  return p * scale;
+}
+
+#ifdef __SSE2__
+/**
+   Exponential of two values, see 'exp_in_place'.
+ */
+inline __m128d exp_sse2(__m128d x) {
+  const __m128d shift = _mm_set1_pd(round_shift);
+  x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(exp_min)), _mm_set1_pd(exp_max));
+
+  __m128d shifted = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(log2e)), shift);
+  __m128d n = _mm_sub_pd(shifted, shift);
+  __m128d r = _mm_sub_pd(_mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(ln2_hi))),
+                         _mm_mul_pd(n, _mm_set1_pd(ln2_lo)));
+
+  __m128d p = _mm_set1_pd(exp_coefficients[0]);
+  for (unsigned int i = 1; i < 13; i++)
+    p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coefficients[i]));
+
+  __m128i scale_bits = _mm_slli_epi64(
+      _mm_add_epi64(_mm_castpd_si128(shifted),
+                    _mm_set1_epi64x(1023 - round_shift_bits)),
+      52);
+
+  return _mm_mul_pd(p, _mm_castsi128_pd(scale_bits));
+}
+#endif
+
+void exp_in_place(double *values, const unsigned int count) {
+  unsigned int k = 0;
+
+#ifdef __SSE2__
+  for (; k + 4 <= count; k += 4) {
+    __m128d low = exp_sse2(_mm_loadu_pd(values + k));
+    __m128d high = exp_sse2(_mm_loadu_pd(values + k + 2));
+    _mm_storeu_pd(values + k, low);
+    _mm_storeu_pd(values + k + 2, high);
+  }
+#endif
+
+  for (; k < count; k++)
+    values[k] = exp_scalar(values[k]);
+}
@@ -0,0 +1,114 @@
+#include "fasta_helper.h"
+#include "pll_smc.h"
+#include "test_helper.h"
+
+/**
+   Jukes-Cantor distance between two sequences computed site by site. Sites
+   match if their state sets intersect, unknown characters match every state.
+ */
+double naive_distance(const std::string &a, const std::string &b) {
+  unsigned int mismatches = 0;
+  for (unsigned int s = 0; s < a.length(); s++) {
+    pll_state_t a_states = pll_map_nt[(unsigned char)a[s]] & 0xF;
+    pll_state_t b_states = pll_map_nt[(unsigned char)b[s]] & 0xF;
+    if (a_states && b_states && !(a_states & b_states))
+      mismatches++;
+  }
+
+  double proportion = (double)mismatches / a.length();
+  proportion = std::min(proportion, 0.75 - 1.0 / (4.0 * a.length()));
+
+  return -0.75 * log(1.0 - 4.0 / 3.0 * proportion);
+}
+
+void check_distances(
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    ThreadPool &thread_pool) {
+  const DistanceMatrix distance_matrix(sequences, thread_pool);
+
+  CHECK(distance_matrix.get_sequence_count() == sequences.size());
+  CHECK(distance_matrix.get_site_count() == sequences[0].second.length());
+
+  for (unsigned int i = 0; i < sequences.size(); i++) {
+    for (unsigned int j = 0; j < sequences.size(); j++) {
+      double expected =
+          i == j ? 0.0
+                 : naive_distance(sequences[i].second, sequences[j].second);
+      // Distances are stored in single precision.
+      CHECK_NEAR(distance_matrix.distance(i, j), expected, 1e-6);
+    }
+  }
+}
+
+int main() {
+  ThreadPool thread_pool(2);
+
+  auto sequences = parse_sequences(test_data("small.fasta"));
+  check_distances(sequences, thread_pool);
+
+  // Random sequences whose length isn't a multiple of the 16 sites of a
+  // word, including a pair of saturated ones.
+  std::mt19937 mt_generator(5);
+  const std::string characters = "ACGTACGTACGTNRY-";
+  std::uniform_int_distribution<int> character_dist(0, characters.size() - 1);
+  std::vector<std::pair<std::string, std::string>> random_sequences;
+  for (unsigned int i = 0; i < 9; i++) {
+    std::string sequence;
+    for (unsigned int s = 0; s < 37; s++)
+      sequence += characters[character_dist(mt_generator)];
+    random_sequences.push_back({"random" + std::to_string(i), sequence});
+  }
+  random_sequences.push_back({"saturated0", std::string(37, 'A')});
+  random_sequences.push_back({"saturated1", std::string(37, 'C')});
+  check_distances(random_sequences, thread_pool);
+
+  // Root distances are the average distances between the roots' leaves.
+  const DistanceMatrix distance_matrix(sequences, thread_pool);
+  const ReferencePartitions reference_partitions(sequences, {});
+  PLLBufferManager manager;
+  PhyloForest forest(sequences, sequences[0].second.length(),
+                     &reference_partitions, &manager, &distance_matrix);
+  forest.connect(0, 1, 0.1);
+  forest.connect(0, 1, 0.1);
+  forest.connect(4, 3, 0.1);
+
+  std::vector<std::vector<unsigned int>> root_leaves;
+  for (auto &root : forest.get_roots()) {
+    std::vector<unsigned int> leaves;
+    std::vector<std::shared_ptr<PhyloTreeNode>> stack = {root};
+    while (!stack.empty()) {
+      std::shared_ptr<PhyloTreeNode> node = stack.back();
+      stack.pop_back();
+      if (node->edge_l) {
+        stack.push_back(node->edge_l->child);
+        stack.push_back(node->edge_r->child);
+      } else {
+        leaves.push_back(node->tip_index);
+      }
+    }
+    root_leaves.push_back(leaves);
+  }
+
+  std::vector<unsigned int> sequence_roots = forest.sequence_roots();
+  for (unsigned int k = 0; k < forest.root_count(); k++)
+    for (unsigned int x : root_leaves[k])
+      CHECK(sequence_roots[x] == k);
+
+  for (unsigned int k = 0; k < forest.root_count(); k++) {
+    std::vector<double> distances = forest.root_distances(k);
+    CHECK(distances.size() == forest.root_count());
+
+    for (unsigned int l = 0; l < forest.root_count(); l++) {
+      double expected = 0.0;
+      if (l != k) {
+        for (unsigned int x : root_leaves[k])
+          for (unsigned int y : root_leaves[l])
+            expected += distance_matrix.distance(x, y);
+        expected /= root_leaves[k].size() * root_leaves[l].size();
+      }
+      CHECK_NEAR(distances[l], expected, 1e-12);
+    }
+  }
+
+  return test_result();
+}
@@ -0,0 +1,80 @@
+#ifndef TEST_TEST_HELPER_H
+#define TEST_TEST_HELPER_H
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+/**
+   Number of failed checks of the test executable.
+ */
+inline unsigned int &failed_checks() {
+  static unsigned int failed = 0;
+  return failed;
+}
+
+/**
+   Records a failed check unless 'condition' holds. Unlike assert, checks are
+   kept in release builds.
+ */
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: "          \
+                << #condition << std::endl;                                    \
+      failed_checks()++;                                                       \
+    }                                                                          \
+  } while (false)
+
+/**
+   Records a failed check unless 'actual' is within 'tolerance' of
+   'expected'.
+ */
+#define CHECK_NEAR(actual, expected, tolerance)                                \
+  do {                                                                         \
+    const double check_actual = (actual);                                      \
+    const double check_expected = (expected);                                  \
+    if (!(std::fabs(check_actual - check_expected) <= (tolerance))) {          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: "          \
+                << #actual << " is " << check_actual << ", expected "          \
+                << check_expected << std::endl;                                \
+      failed_checks()++;                                                       \
+    }                                                                          \
+  } while (false)
+
+/**
+   Records a failed check unless 'statement' throws an 'exception'.
+ */
+#define CHECK_THROWS(statement, exception)                                     \
+  do {                                                                         \
+    bool check_thrown = false;                                                 \
+    try {                                                                      \
+      statement;                                                               \
+    } catch (const exception &) {                                              \
+      check_thrown = true;                                                     \
+    }                                                                          \
+    if (!check_thrown) {                                                       \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: "          \
+                << #statement << " didn't throw " << #exception << std::endl;  \
+      failed_checks()++;                                                       \
+    }                                                                          \
+  } while (false)
+
+/**
+   Path of the test data file 'name'.
+ */
+inline std::string test_data(const std::string &name) {
+  return TEST_DATA_DIR + name;
+}
+
+/**
+   Exit status of the test executable.
+ */
+inline int test_result() {
+  if (failed_checks() > 0)
+    std::cerr << failed_checks() << " checks failed" << std::endl;
+
+  return failed_checks() > 0 ? 1 : 0;
+}
+
+#endif
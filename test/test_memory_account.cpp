@@ -0,0 +1,110 @@
+#include <sstream>
+#include <stdexcept>
+
+#include "phylo_tree.h"
+#include "pll_buffer_manager.h"
+#include "test_helper.h"
+
+int main() {
+  const size_t buffer_size = 1024;
+
+  MemoryAccount account;
+  account.budget = 4 * buffer_size;
+
+  PLLBufferManager first_manager;
+  PLLBufferManager second_manager;
+  first_manager.set_memory_account(&account);
+  second_manager.set_memory_account(&account);
+
+  // Three buffers pooled by the first manager.
+  double *buffers[3];
+  for (auto &buffer : buffers)
+    buffer = first_manager.acquire(first_manager.clv_buffer,
+                                   MemoryCategory::CLV, buffer_size);
+  for (auto &buffer : buffers)
+    first_manager.recycle(first_manager.clv_buffer, MemoryCategory::CLV,
+                          buffer);
+  CHECK(account.get_pooled(MemoryCategory::CLV) == 3 * buffer_size);
+
+  // The second manager reclaims the first one's pool instead of failing.
+  double *pmatrices[4];
+  for (auto &pmatrix : pmatrices)
+    pmatrix = second_manager.acquire(second_manager.pmatrix_buffer,
+                                     MemoryCategory::PMATRIX, buffer_size);
+  CHECK(account.get_pooled(MemoryCategory::CLV) == 0);
+  CHECK(account.get_live(MemoryCategory::PMATRIX) == 4 * buffer_size);
+  CHECK(account.total() <= account.budget);
+
+  // Without pooled memory left the budget is enforced.
+  CHECK_THROWS(second_manager.acquire(second_manager.pmatrix_buffer,
+                                      MemoryCategory::PMATRIX, buffer_size),
+               std::runtime_error);
+
+  for (auto &pmatrix : pmatrices)
+    second_manager.release(second_manager.pmatrix_buffer,
+                           MemoryCategory::PMATRIX, pmatrix);
+  CHECK(account.total() == 0);
+
+  // A node whose scale buffer exceeds the budget returns its clv and isn't
+  // accounted.
+  {
+    PLLBufferManager manager;
+    manager.memory_account->budget =
+        2 * sizeof(PhyloTreeNode) + 2 * sizeof(PhyloTreeEdge) +
+        2 * buffer_size + buffer_size;
+
+    auto left = std::make_shared<PhyloTreeNode>(&manager, "left", 0);
+    auto right = std::make_shared<PhyloTreeNode>(&manager, "right", 1);
+    auto edge_left =
+        std::make_shared<PhyloTreeEdge>(&manager, left, 0.1, buffer_size);
+    auto edge_right =
+        std::make_shared<PhyloTreeEdge>(&manager, right, 0.1, buffer_size);
+
+    CHECK_THROWS(std::make_shared<PhyloTreeNode>(&manager, edge_left,
+                                                 edge_right, "", 0.1,
+                                                 buffer_size, buffer_size),
+                 std::runtime_error);
+    CHECK(manager.memory_account->get_live(MemoryCategory::CLV) == 0);
+    CHECK(manager.memory_account->get_live(MemoryCategory::SCALER) == 0);
+    CHECK(manager.memory_account->get_live(MemoryCategory::NODE) ==
+          2 * sizeof(PhyloTreeNode));
+
+    // An edge whose pmatrix exceeds the budget isn't accounted either.
+    manager.free_pooled_buffers();
+    manager.memory_account->budget = manager.memory_account->total();
+    CHECK_THROWS(
+        std::make_shared<PhyloTreeEdge>(&manager, left, 0.1, buffer_size),
+        std::runtime_error);
+    CHECK(manager.memory_account->get_live(MemoryCategory::EDGE) ==
+          2 * sizeof(PhyloTreeEdge));
+  }
+
+  // Degrading is recorded once for the owner of the account to report.
+  {
+    MemoryAccount degrade_account;
+    degrade_account.budget = 4 * buffer_size;
+    degrade_account.degrade_on_budget = true;
+    PLLBufferManager manager;
+    manager.set_memory_account(&degrade_account);
+
+    double *clvs[4];
+    for (auto &clv : clvs)
+      clv = manager.acquire(manager.clv_buffer, MemoryCategory::CLV,
+                            buffer_size);
+    CHECK(manager.clv_precision == CLVPrecision::SINGLE);
+    CHECK(degrade_account.take_degradation());
+    CHECK(!degrade_account.take_degradation());
+
+    for (auto &clv : clvs)
+      manager.release(manager.clv_buffer, MemoryCategory::CLV, clv);
+  }
+
+  // Reports leave the formatting of the stream unchanged.
+  std::ostringstream stream;
+  stream.precision(4);
+  account.report(stream);
+  CHECK(stream.str().find("Memory peak: ") == 0);
+  CHECK(stream.precision() == 4 && !(stream.flags() & std::ios::fixed));
+
+  return test_result();
+}
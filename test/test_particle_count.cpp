@@ -0,0 +1,44 @@
+#include "pll_smc.h"
+#include "test_helper.h"
+
+int main() {
+  SMCOptions options;
+
+  // Without a target the count is never changed, not even clamped.
+  CHECK(initial_particle_count(7, options) == 7);
+  CHECK(initial_particle_count(500000, options) == 500000);
+  CHECK(adapt_particle_count(7, 1.0, options) == 7);
+  CHECK(adapt_particle_count(1000, 999.0, options) == 1000);
+
+  options.target_ess = 500.0;
+  options.min_particle_count = 100;
+  options.max_particle_count = 10000;
+
+  CHECK(initial_particle_count(50, options) == 100);
+  CHECK(initial_particle_count(1000, options) == 1000);
+  CHECK(initial_particle_count(20000, options) == 10000);
+
+  // The count follows the ratio of ESS to count...
+  CHECK(adapt_particle_count(1000, 800.0, options) == 625);
+  CHECK(adapt_particle_count(1000, 400.0, options) == 1250);
+  CHECK(adapt_particle_count(1000, 500.0, options) == 1000);
+
+  // ...but changes by at most a factor of two per generation.
+  CHECK(adapt_particle_count(1000, 10.0, options) == 2000);
+  CHECK(adapt_particle_count(1000, 0.0, options) == 2000);
+  CHECK(adapt_particle_count(1000, 1000.0 * 1000, options) == 500);
+
+  // Within the bounds.
+  CHECK(adapt_particle_count(150, 1000.0, options) == 100);
+  CHECK(adapt_particle_count(8000, 1.0, options) == 10000);
+
+  // If the bounds cross, the maximum wins.
+  options.min_particle_count = 2000;
+  options.max_particle_count = 1000;
+  CHECK(initial_particle_count(50, options) == 1000);
+  CHECK(initial_particle_count(5000, options) == 1000);
+  CHECK(adapt_particle_count(800, 800.0, options) == 1000);
+  CHECK(adapt_particle_count(3000, 1.0, options) == 1000);
+
+  return test_result();
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cmath>
+
+#include "fasta_helper.h"
+#include "pll_smc.h"
+#include "test_helper.h"
+
+/**
+   Shard of 'particle' given the shard offsets 'shards'.
+ */
+unsigned int shard_of(const unsigned int particle,
+                      const std::vector<unsigned int> &shards) {
+  return std::upper_bound(shards.begin(), shards.end(), particle) -
+         shards.begin() - 1;
+}
+
+/**
+   Checks 'place_offspring' for random ancestors drawn from a generation with
+   the shard offsets 'generation_shards'.
+ */
+void check_place_offspring(const std::vector<unsigned int> &generation_shards,
+                           const std::vector<unsigned int> &next_shards,
+                           std::mt19937 &mt_generator) {
+  const unsigned int shard_count = next_shards.size() - 1;
+  std::uniform_int_distribution<unsigned int> ancestor_dist(
+      0, generation_shards.back() - 1);
+
+  std::vector<unsigned int> ancestors(next_shards.back());
+  for (auto &ancestor : ancestors)
+    ancestor = ancestor_dist(mt_generator);
+  std::sort(ancestors.begin(), ancestors.end());
+  std::vector<unsigned int> sorted = ancestors;
+
+  unsigned int moved =
+      place_offspring(ancestors, generation_shards, next_shards);
+
+  // Every offspring is placed exactly once.
+  std::vector<unsigned int> placed = ancestors;
+  std::sort(placed.begin(), placed.end());
+  CHECK(placed == sorted);
+
+  // Offspring stay in their ancestor's shard as long as it has free slots.
+  unsigned int expected_moved = 0;
+  for (unsigned int shard = 0; shard < shard_count; shard++) {
+    unsigned int offspring = 0;
+    for (unsigned int ancestor : sorted)
+      offspring += shard_of(ancestor, generation_shards) == shard;
+
+    unsigned int slots = next_shards[shard + 1] - next_shards[shard];
+    unsigned int kept = 0;
+    for (unsigned int slot = next_shards[shard];
+         slot < next_shards[shard + 1]; slot++)
+      kept += shard_of(ancestors[slot], generation_shards) == shard;
+
+    CHECK(kept == std::min(offspring, slots));
+    expected_moved += offspring - kept;
+  }
+  CHECK(moved == expected_moved);
+}
+
+int main() {
+  std::mt19937 mt_generator(7);
+
+  check_place_offspring({0, 10, 20}, {0, 10, 20}, mt_generator);
+  check_place_offspring({0, 5, 20}, {0, 12, 20}, mt_generator);
+  check_place_offspring({0, 0, 7, 30}, {0, 10, 10, 25}, mt_generator);
+  for (unsigned int trial = 0; trial < 20; trial++)
+    check_place_offspring({0, 3, 9, 16, 40}, {0, 14, 15, 29, 33},
+                          mt_generator);
+
+  // All offspring of a single ancestor fill their shard first.
+  std::vector<unsigned int> ancestors(8, 2);
+  CHECK(place_offspring(ancestors, {0, 4, 8}, {0, 4, 8}) == 4);
+  CHECK(ancestors == std::vector<unsigned int>(8, 2));
+
+  auto sequences = parse_sequences(test_data("small.fasta"));
+  const ReferencePartitions reference_partitions(sequences, {});
+  PLLBufferManager first_manager, second_manager, third_manager;
+  ThreadPool thread_pool(3, fake_numa_topology(3));
+
+  ParticlePopulation population(
+      10, sequences, &reference_partitions,
+      {&first_manager, &second_manager, &third_manager}, nullptr, {1, 2, 3},
+      &thread_pool);
+  CHECK(population.shard_count() == 3);
+
+  // Shards are proportional to their weights and add up to the count.
+  for (unsigned int count : {0u, 1u, 5u, 6u, 10u, 99u, 1000u}) {
+    std::vector<unsigned int> sizes = population.shard_sizes(count);
+    CHECK(sizes.size() == 3);
+
+    unsigned int sum = 0;
+    for (unsigned int shard = 0; shard < sizes.size(); shard++) {
+      sum += sizes[shard];
+      CHECK(std::fabs(sizes[shard] - count * (shard + 1) / 6.0) < 1.0);
+    }
+    CHECK(sum == count);
+  }
+
+  // Every particle of a shard uses the shard's buffer manager, also after
+  // resizing.
+  std::vector<PLLBufferManager *> managers = {&first_manager, &second_manager,
+                                              &third_manager};
+  auto check_shards = [&](const std::vector<Particle *> &particles,
+                          const std::vector<unsigned int> &shards) {
+    CHECK(shards.size() == 4 && shards.back() == particles.size());
+    for (unsigned int i = 0; i < particles.size(); i++)
+      CHECK(particles[i]->get_forest()->get_buffer_manager() ==
+            managers[shard_of(i, shards)]);
+  };
+
+  check_shards(population.get_generation(),
+               population.get_generation_shards());
+  for (unsigned int count : {30u, 7u, 12u}) {
+    population.resize_next_generation(count);
+    CHECK(population.get_next_generation().size() == count);
+    check_shards(population.get_next_generation(),
+                 population.get_next_generation_shards());
+  }
+
+  return test_result();
+}
@@ -0,0 +1,124 @@
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include "fasta_helper.h"
+#include "partition_helper.h"
+#include "phylo_forest.h"
+#include "test_helper.h"
+
+/**
+   Path of the partition file written by 'parse_text', in the working
+   directory of the test.
+ */
+const std::string partition_path = "test_partition_helper.part";
+
+/**
+   Writes 'text' as the partition file and parses it for 'column_count'
+   columns.
+ */
+std::vector<AlignmentPartition> parse_text(const std::string &text,
+                                           unsigned int column_count) {
+  {
+    std::ofstream file(partition_path);
+    file << text;
+  }
+
+  return parse_partitions(partition_path, column_count);
+}
+
+int main() {
+  std::vector<AlignmentPartition> partitions =
+      parse_text("# Three genes\n"
+                 "GTR{1/2/1/1/2/1}+G{0.5}+FC, gene1 = 1-6\n"
+                 "\n"
+                 "  JC, gene2 = 7, 8-9\r\n"
+                 "DNA+FU{0.1/0.2/0.3/0.4}, gene3 = 10-14\\2, 11-14\\2\n",
+                 14);
+
+  CHECK(partitions.size() == 3);
+  if (partitions.size() == 3) {
+    const AlignmentPartition &gene1 = partitions[0];
+    CHECK(gene1.name == "gene1");
+    CHECK((gene1.columns == std::vector<unsigned int>{0, 1, 2, 3, 4, 5}));
+    CHECK(gene1.subst_params[0] == 1 && gene1.subst_params[1] == 2 &&
+          gene1.subst_params[4] == 2 && gene1.subst_params[5] == 1);
+    CHECK(gene1.gamma_rates && gene1.gamma_alpha == 0.5);
+    CHECK(gene1.empirical_frequencies);
+
+    const AlignmentPartition &gene2 = partitions[1];
+    CHECK(gene2.name == "gene2");
+    CHECK((gene2.columns == std::vector<unsigned int>{6, 7, 8}));
+    CHECK(gene2.subst_params[1] == 1);
+    CHECK(!gene2.empirical_frequencies);
+    CHECK(!gene2.gamma_rates);
+    CHECK(gene2.frequencies[0] == 0.25);
+
+    const AlignmentPartition &gene3 = partitions[2];
+    CHECK(gene3.name == "gene3");
+    CHECK((gene3.columns == std::vector<unsigned int>{9, 11, 13, 10, 12}));
+    CHECK(gene3.frequencies[0] == 0.1 && gene3.frequencies[3] == 0.4);
+  }
+
+  // Without '+G' all rate categories have rate 1, '+G' alone has alpha 1
+  // like the default model of an unpartitioned alignment.
+  auto sequences = parse_sequences(test_data("small.fasta"));
+  const unsigned int length = sequences[0].second.length();
+  const std::string range = " = 1-" + std::to_string(length) + "\n";
+  double ln_likelihoods[4];
+  std::vector<std::vector<AlignmentPartition>> models = {
+      parse_text("JC, gene" + range, length),
+      parse_text("GTR, gene" + range, length),
+      parse_text("JC+G{1}, gene" + range, length), {}};
+  for (unsigned int m = 0; m < models.size(); m++) {
+    const ReferencePartitions reference_partitions(sequences, models[m]);
+    const pll_partition_t *partition = reference_partitions.get_partition(0);
+    CHECK(partition->rate_cats == 4);
+    CHECK((partition->rates[0] == 1.0) == (m < 2));
+
+    PLLBufferManager manager;
+    PhyloForest forest(sequences, length, &reference_partitions, &manager);
+    while (forest.root_count() > 1)
+      forest.connect(0, 1, 0.05);
+    ln_likelihoods[m] = forest.get_roots().front()->ln_likelihood;
+  }
+  CHECK(ln_likelihoods[0] == ln_likelihoods[1]);
+  CHECK(std::fabs(ln_likelihoods[0] - ln_likelihoods[2]) > 1e-3);
+  CHECK(ln_likelihoods[2] == ln_likelihoods[3]);
+
+  // Uncovered columns are allowed.
+  CHECK(parse_text("JC, gene = 2-3\n", 5).size() == 1);
+
+  CHECK_THROWS(parse_partitions("missing.part", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("# Only a comment\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC gene = 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("WAG, gene = 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC+I, gene = 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("GTR{1/2/1}, gene = 1-10\n", 10),
+               std::runtime_error);
+  CHECK_THROWS(parse_text("GTR{1/2/1/1/2/1, gene = 1-10\n", 10),
+               std::runtime_error);
+  CHECK_THROWS(parse_text("JC+FU, gene = 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC+G{x}, gene = 1-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = a-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = 0-10\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = 1-11\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = 5-4\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = 1-10\\0\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, gene = 1-2-3\n", 10), std::runtime_error);
+  CHECK_THROWS(parse_text("JC, a = 1-5\nJC, b = 5-10\n", 10),
+               std::runtime_error);
+
+  // Errors name the file and line.
+  try {
+    parse_text("JC, a = 1-5\n\nJC, b = 12\n", 10);
+    CHECK(false);
+  } catch (const std::runtime_error &error) {
+    CHECK(std::string(error.what()).find(partition_path + ":3:") == 0);
+  }
+
+  std::remove(partition_path.c_str());
+
+  return test_result();
+}
@@ -0,0 +1,98 @@
+#include <random>
+
+#include "fasta_helper.h"
+#include "reference_partitions.h"
+#include "test_helper.h"
+
+/**
+   Partition over the columns [begin, end).
+ */
+AlignmentPartition make_partition(const std::string &name,
+                                  const unsigned int begin,
+                                  const unsigned int end) {
+  AlignmentPartition partition;
+  partition.name = name;
+  for (unsigned int c = begin; c < end; c++)
+    partition.columns.push_back(c);
+
+  return partition;
+}
+
+int main() {
+  auto sequences = parse_sequences(test_data("small.fasta"));
+
+  // Jukes-Cantor without rate heterogeneity, GTR with a strong gamma and
+  // fixed unequal frequencies.
+  AlignmentPartition jc = make_partition("jc", 0, 80);
+  AlignmentPartition gtr = make_partition("gtr", 80, 160);
+  const double subst_params[6] = {1.2, 4.1, 0.6, 0.9, 3.8, 1.0};
+  std::copy(subst_params, subst_params + 6, gtr.subst_params);
+  gtr.gamma_rates = true;
+  gtr.gamma_alpha = 0.2;
+  gtr.empirical_frequencies = true;
+  AlignmentPartition fu = make_partition("fu", 160, 240);
+  const double frequencies[4] = {0.1, 0.2, 0.3, 0.4};
+  std::copy(frequencies, frequencies + 4, fu.frequencies);
+  fu.gamma_rates = true;
+  fu.gamma_alpha = 3.0;
+
+  const ReferencePartitions reference_partitions(sequences, {jc, gtr, fu});
+  const PMatrixBuilder &builder = reference_partitions.get_pmatrix_builder();
+  CHECK(builder.pmatrix_length() == reference_partitions.pmatrix_length());
+
+  // Zero, tiny and typical lengths, and lengths long enough for the
+  // exponentials to fall below the smallest normal double. More than a tile
+  // of edges, so that several tiles are built.
+  std::vector<double> lengths = {0.0, 1e-300, 1e-12, 1e-6, 0.1,
+                                 1.0, 50.0,   1e3,   1e6,  1e300};
+  std::mt19937 mt_generator(3);
+  std::exponential_distribution<double> length_dist(5.0);
+  while (lengths.size() < 150)
+    lengths.push_back(length_dist(mt_generator));
+
+  const unsigned int pmatrix_length = builder.pmatrix_length();
+  std::vector<double> buffer(lengths.size() * pmatrix_length);
+  std::vector<double *> pmatrices(lengths.size());
+  for (unsigned int e = 0; e < lengths.size(); e++)
+    pmatrices[e] = buffer.data() + e * pmatrix_length;
+  builder.build(lengths.data(), pmatrices.data(), lengths.size());
+
+  const unsigned int partition_length =
+      reference_partitions.partition_pmatrix_length();
+  std::vector<double> expected(partition_length);
+  unsigned int matrix_indices[1] = {0};
+
+  for (unsigned int e = 0; e < lengths.size(); e++) {
+    for (unsigned int i = 0; i < reference_partitions.partition_count(); i++) {
+      const pll_partition_t *p = reference_partitions.get_partition(i);
+      // Only parameter index 0 is used, see create_reference_partition.
+      std::vector<unsigned int> param_indices(p->rate_cats, 0);
+      double *expected_pmatrix = expected.data();
+      pll_core_update_pmatrix(&expected_pmatrix, p->states, p->rate_cats,
+                              p->rates, &lengths[e], matrix_indices,
+                              param_indices.data(), p->prop_invar,
+                              p->eigenvals, p->eigenvecs, p->inv_eigenvecs,
+                              1, p->attributes);
+
+      const double *pmatrix = pmatrices[e] + i * partition_length;
+      for (unsigned int n = 0; n < p->rate_cats; n++) {
+        for (unsigned int j = 0; j < p->states; j++) {
+          for (unsigned int k = 0; k < p->states; k++) {
+            unsigned int index = (n * p->states + j) * p->states_padded + k;
+            CHECK_NEAR(pmatrix[index], expected[index], 1e-14);
+          }
+        }
+      }
+    }
+
+    // Like PLL, a zero length gives exactly the identity.
+    if (lengths[e] == 0.0) {
+      const pll_partition_t *p = reference_partitions.get_partition(0);
+      for (unsigned int j = 0; j < p->states; j++)
+        for (unsigned int k = 0; k < p->states; k++)
+          CHECK(pmatrices[e][j * p->states_padded + k] == (j == k ? 1 : 0));
+    }
+  }
+
+  return test_result();
+}
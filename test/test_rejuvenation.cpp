@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <map>
+
+#include "fasta_helper.h"
+#include "pll_smc.h"
+#include "test_helper.h"
+
+/**
+   Appends the inner nodes below and including 'node' to 'nodes' and returns
+   the smallest tip index below it, which identifies the node's subtree.
+ */
+unsigned int collect_nodes(const std::shared_ptr<PhyloTreeNode> &node,
+                           std::vector<std::shared_ptr<PhyloTreeNode>> &nodes) {
+  if (!node->edge_l)
+    return node->tip_index;
+
+  nodes.push_back(node);
+  return std::min(collect_nodes(node->edge_l->child, nodes),
+                  collect_nodes(node->edge_r->child, nodes));
+}
+
+/**
+   Checks that the trees of 'forest' over 'sequence_count' sequences are
+   well formed: every sequence is a leaf of exactly one root, children are
+   below their parents with matching edge lengths, and the most recent merge
+   is the last root at the forest's height.
+ */
+void check_structure(const PhyloForest &forest,
+                     const unsigned int sequence_count) {
+  std::vector<unsigned int> leaf_roots(sequence_count, 0);
+  std::vector<std::shared_ptr<PhyloTreeNode>> stack;
+  for (auto &root : forest.get_roots()) {
+    stack.push_back(root);
+    unsigned int leaf_count = 0;
+
+    while (!stack.empty()) {
+      std::shared_ptr<PhyloTreeNode> node = stack.back();
+      stack.pop_back();
+
+      if (!node->edge_l) {
+        leaf_roots[node->tip_index]++;
+        leaf_count++;
+        continue;
+      }
+
+      for (auto &edge : {node->edge_l, node->edge_r}) {
+        CHECK(edge->child->height <= node->height);
+        CHECK_NEAR(edge->length, node->height - edge->child->height, 1e-12);
+        stack.push_back(edge->child);
+      }
+    }
+
+    CHECK(root->leaf_count == leaf_count);
+    CHECK(root->height <= forest.get_forest_height());
+  }
+
+  for (unsigned int count : leaf_roots)
+    CHECK(count == 1);
+  CHECK(forest.get_roots().back()->height == forest.get_forest_height());
+}
+
+/**
+   Rebuilds the topology and heights of 'forest' in a new forest by
+   connecting its merges in the order of their heights, and checks that every
+   root has the same log-likelihood as in the rebuilt forest.
+ */
+void check_likelihoods(
+    const PhyloForest &forest,
+    const std::vector<std::pair<std::string, std::string>> &sequences,
+    const ReferencePartitions &reference_partitions) {
+  std::vector<std::shared_ptr<PhyloTreeNode>> nodes;
+  for (auto &root : forest.get_roots())
+    collect_nodes(root, nodes);
+  std::stable_sort(nodes.begin(), nodes.end(),
+                   [](const std::shared_ptr<PhyloTreeNode> &a,
+                      const std::shared_ptr<PhyloTreeNode> &b) {
+                     return a->height < b->height;
+                   });
+
+  PLLBufferManager manager;
+  PhyloForest rebuilt(sequences, sequences[0].second.length(),
+                      &reference_partitions, &manager);
+
+  // Roots of the rebuilt forest by the smallest tip index below them.
+  auto find_root = [&](unsigned int tip) {
+    std::vector<std::shared_ptr<PhyloTreeNode>> unused;
+    for (unsigned int r = 0; r < rebuilt.root_count(); r++)
+      if (collect_nodes(rebuilt.get_roots()[r], unused) == tip)
+        return (int)r;
+    return -1;
+  };
+
+  std::map<unsigned int, double> ln_likelihoods;
+  for (auto &node : nodes) {
+    std::vector<std::shared_ptr<PhyloTreeNode>> unused;
+    int i = find_root(collect_nodes(node->edge_l->child, unused));
+    int j = find_root(collect_nodes(node->edge_r->child, unused));
+    CHECK(i >= 0 && j >= 0);
+    if (i < 0 || j < 0)
+      return;
+
+    double height_delta = node->height - rebuilt.get_forest_height();
+    ln_likelihoods[collect_nodes(node, unused)] =
+        rebuilt.connect(i, j, height_delta)->ln_likelihood;
+  }
+
+  CHECK(rebuilt.root_count() == forest.root_count());
+  for (auto &root : forest.get_roots()) {
+    std::vector<std::shared_ptr<PhyloTreeNode>> unused;
+    if (root->edge_l)
+      CHECK_NEAR(root->ln_likelihood,
+                 ln_likelihoods[collect_nodes(root, unused)], 1e-9);
+  }
+}
+
+int main() {
+  auto sequences = parse_sequences(test_data("small.fasta"));
+  const unsigned int sequence_lengths = sequences[0].second.length();
+  const ReferencePartitions reference_partitions(sequences, {});
+  PLLBufferManager manager;
+
+  std::mt19937 mt_generator(11);
+
+  // Forests with all numbers of merges, up to a single tree.
+  for (unsigned int merges = 0; merges < sequences.size(); merges++) {
+    PhyloForest forest(sequences, sequence_lengths, &reference_partitions,
+                       &manager);
+    for (unsigned int merge = 0; merge < merges; merge++) {
+      std::uniform_int_distribution<int> int_dist(0, forest.root_count() - 2);
+      int i = int_dist(mt_generator);
+      double root_count = forest.root_count();
+      std::exponential_distribution<double> exponential_dist(
+          root_count * (root_count - 1) / 2);
+      forest.connect(i, forest.root_count() - 1,
+                     exponential_dist(mt_generator));
+    }
+
+    const unsigned int root_count = forest.root_count();
+    unsigned int proposed[2] = {0, 0};
+    unsigned int accepted[2] = {0, 0};
+    for (unsigned int move = 0; move < 200; move++) {
+      MoveResult result = move % 2 == 0
+                              ? forest.rejuvenate_height(mt_generator)
+                              : forest.rejuvenate_exchange(mt_generator);
+      proposed[move % 2] += result != MoveResult::NOT_PROPOSED;
+      accepted[move % 2] += result == MoveResult::ACCEPTED;
+
+      CHECK(forest.root_count() == root_count);
+      check_structure(forest, sequences.size());
+    }
+    check_likelihoods(forest, sequences, reference_partitions);
+
+    // Without merges neither move applies, otherwise height moves always
+    // apply and some are accepted.
+    if (merges == 0) {
+      CHECK(proposed[0] == 0 && proposed[1] == 0);
+    } else {
+      CHECK(proposed[0] == 100);
+      CHECK(accepted[0] > 0 && accepted[0] < 100);
+    }
+    if (merges == sequences.size() - 1)
+      CHECK(accepted[1] > 0);
+  }
+
+  // A particle counts only the moves which could be proposed.
+  Particle particle(0.0, sequences, sequence_lengths, &reference_partitions,
+                    &manager);
+  unsigned int proposed_count = 0;
+  CHECK(particle.rejuvenate(50, proposed_count) == 0);
+  CHECK(proposed_count == 0);
+  for (unsigned int merge = 0; merge + 1 < sequences.size(); merge++)
+    particle.propose();
+  unsigned int accepted_count = particle.rejuvenate(200, proposed_count);
+  CHECK(proposed_count > 0 && proposed_count <= 200);
+  CHECK(accepted_count > 0 && accepted_count <= proposed_count);
+  check_structure(*particle.get_forest(), sequences.size());
+  check_likelihoods(*particle.get_forest(), sequences, reference_partitions);
+
+  return test_result();
+}
@@ -0,0 +1,69 @@
+#include "fasta_helper.h"
+#include "pll_smc.h"
+#include "test_helper.h"
+
+/**
+   Builds the same random tree in 'forests', switching 'switched_manager' to
+   single precision after 'switch_after' merges. Returns the largest
+   log-likelihood difference between the forests' nodes.
+ */
+double build_random_trees(PhyloForest &double_forest,
+                          PhyloForest &mixed_forest,
+                          PLLBufferManager &switched_manager,
+                          const unsigned int switch_after) {
+  std::mt19937 mt_generator(3);
+  double max_difference = 0.0;
+
+  for (unsigned int merge = 0; double_forest.root_count() > 1; merge++) {
+    if (merge == switch_after)
+      switched_manager.clv_precision = CLVPrecision::SINGLE;
+
+    std::uniform_int_distribution<int> int_dist(
+        0, double_forest.root_count() - 1);
+    int i = int_dist(mt_generator);
+    int j = int_dist(mt_generator);
+    if (i == j)
+      continue;
+
+    double height = 0.05;
+    double double_ln_likelihood = double_forest.connect(i, j, height)->ln_likelihood;
+    double mixed_ln_likelihood = mixed_forest.connect(i, j, height)->ln_likelihood;
+
+    max_difference = std::max(
+        max_difference, fabs(double_ln_likelihood - mixed_ln_likelihood));
+  }
+
+  return max_difference;
+}
+
+int main() {
+  auto sequences = parse_sequences(test_data("small.fasta"));
+  const unsigned int sequence_lengths = sequences[0].second.length();
+
+  // Random trees built with single precision CLVs stay close to double
+  // precision.
+  double difference = validate_single_precision(sequences, 20);
+  CHECK(difference > 0.0);
+  CHECK(difference < 1e-3);
+
+  // Nodes with double precision children and a single precision parent, as
+  // after degrading on a memory budget.
+  const ReferencePartitions reference_partitions(sequences, {});
+  PLLBufferManager double_manager;
+  PLLBufferManager switched_manager;
+  {
+    PhyloForest double_forest(sequences, sequence_lengths,
+                              &reference_partitions, &double_manager);
+    PhyloForest mixed_forest(sequences, sequence_lengths,
+                             &reference_partitions, &switched_manager);
+
+    CHECK(build_random_trees(double_forest, mixed_forest, switched_manager,
+                             3) < 1e-3);
+  }
+
+  // Buffers of both precisions went back to the pool.
+  CHECK(switched_manager.memory_account->get_live(MemoryCategory::CLV) == 0);
+  CHECK(switched_manager.memory_account->get_live(MemoryCategory::SCALER) == 0);
+
+  return test_result();
+}
@@ -0,0 +1,47 @@
+#include "fasta_helper.h"
+#include "smc_engine.h"
+#include "test_helper.h"
+
+int main() {
+  auto sequences = parse_sequences(test_data("small.fasta"));
+
+  SMCOptions options;
+  options.thread_count = 2;
+  options.progress = false;
+  SMCEngine engine(options);
+  const MemoryAccount &account = engine.get_memory_account();
+
+  // Alignments of different lengths each need buffers of their own sizes.
+  // The pools of earlier lengths are freed, so pooled memory doesn't grow
+  // with the number of lengths run.
+  size_t first_pooled = 0;
+  for (unsigned int length = 200; length <= 240; length += 10) {
+    std::vector<std::pair<std::string, std::string>> cut = sequences;
+    for (auto &sequence : cut)
+      sequence.second.resize(length);
+
+    std::vector<SMCTree> trees = engine.run(20, cut);
+    CHECK(!trees.empty());
+    CHECK(account.get_live(MemoryCategory::CLV) == 0);
+
+    size_t pooled = account.get_pooled(MemoryCategory::CLV);
+    CHECK(pooled > 0);
+    if (length == 200)
+      first_pooled = pooled;
+    CHECK(pooled <= first_pooled * 3 / 2);
+  }
+
+  // A batch of different lengths leaves at most the pools of one of them.
+  std::vector<std::vector<std::pair<std::string, std::string>>> alignments;
+  for (unsigned int length = 100; length <= 240; length += 20) {
+    alignments.push_back(sequences);
+    for (auto &sequence : alignments.back())
+      sequence.second.resize(length);
+  }
+  std::vector<std::vector<SMCTree>> results = engine.run_batch(20, alignments);
+  CHECK(results.size() == alignments.size());
+  CHECK(account.get_live(MemoryCategory::CLV) == 0);
+  CHECK(account.get_pooled(MemoryCategory::CLV) <= first_pooled * 3 / 2);
+
+  return test_result();
+}
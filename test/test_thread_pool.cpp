@@ -0,0 +1,74 @@
+#include <stdexcept>
+
+#include "test_helper.h"
+#include "thread_pool.h"
+
+int main() {
+  // Outer tasks, like the jobs of a batch, wait for inner tasks of their
+  // own. A waiting thread must never run another outer task nested on its
+  // stack. Without worker threads the queued outer tasks are always ahead of
+  // the inner ones.
+  {
+    ThreadPool thread_pool(1);
+    const unsigned int outer_count = 16;
+
+    unsigned int depth = 0;
+    unsigned int max_depth = 0;
+    unsigned int inner_sum = 0;
+    std::atomic<unsigned int> pending(outer_count);
+    for (unsigned int i = 0; i < outer_count; i++) {
+      thread_pool.submit(
+          [&]() {
+            depth++;
+            max_depth = std::max(max_depth, depth);
+
+            std::atomic<unsigned int> inner_pending(1);
+            thread_pool.submit(
+                [&]() {
+                  inner_sum += 1;
+                  inner_pending--;
+                },
+                inner_pending);
+            thread_pool.wait(inner_pending);
+
+            depth--;
+            pending--;
+          },
+          pending);
+    }
+    thread_pool.wait(pending);
+
+    CHECK(max_depth == 1);
+    CHECK(inner_sum == outer_count);
+  }
+
+  // Tasks placed on the nodes of a topology all run, also when nested, and
+  // the first exception is rethrown.
+  {
+    ThreadPool thread_pool(4, fake_numa_topology(2));
+    CHECK(thread_pool.node_count() == 2);
+    CHECK(thread_pool.node_size(0) + thread_pool.node_size(1) == 4);
+
+    std::vector<unsigned int> nodes = {0, 1, 1, 0, 1, 1};
+    std::vector<unsigned int> sums(nodes.size(), 0);
+    thread_pool.run_on_nodes(nodes, [&](unsigned int i) {
+      std::atomic<unsigned int> sum(0);
+      thread_pool.parallel_for(0, 10 * (i + 1),
+                               [&](unsigned int k) { sum += k; });
+      sums[i] = sum;
+    });
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+      const unsigned int count = 10 * (i + 1);
+      CHECK(sums[i] == count * (count - 1) / 2);
+    }
+
+    CHECK_THROWS(thread_pool.run_on_nodes(nodes,
+                                          [](unsigned int i) {
+                                            if (i == 2)
+                                              throw std::runtime_error("");
+                                          }),
+                 std::runtime_error);
+  }
+
+  return test_result();
+}